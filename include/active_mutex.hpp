@@ -11,9 +11,39 @@
 #define _ZEENO_ACTIVE_MUTEX_HPP
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
 
-#if defined(__has_feature) && __has_feature(thread_sanitizer)
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#	include <intrin.h>
+#endif
+
+// GCC tells by __SANITIZE_THREAD__, clang by __has_feature, which GCC may not even know
+#if defined(__SANITIZE_THREAD__)
+#	define _ZEENO_ACTIVE_MUTEX_TSAN
+#elif defined(__has_feature)
+#	if __has_feature(thread_sanitizer)
+#		define _ZEENO_ACTIVE_MUTEX_TSAN
+#	endif
+#endif
+
+namespace active_mutex_detail {
+// Issue X86 PAUSE or ARM YIELD instruction to reduce contention between hyper-threads
+inline void pause() noexcept {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+} // namespace active_mutex_detail
+
+#if defined(_ZEENO_ACTIVE_MUTEX_TSAN)
 /*
  * When using thread sanitizer, we care about corectness of the software,
  * not a performance. Thread sanitizer does not detect operations on the atomic
@@ -34,13 +64,7 @@ public:
 			}
 			// Wait for lock to be released without generating cache misses
 			while (flag.load(std::memory_order_relaxed)) {
-// Issue X86 PAUSE (TODO: or ARM YIELD) instruction to reduce contention between
-// hyper-threads
-#	ifdef _MSC_VER
-				_mm_pause();
-#	else
-				__builtin_ia32_pause();
-#	endif
+				active_mutex_detail::pause();
 			}
 		}
 	}
@@ -56,4 +80,156 @@ public:
 	}
 };
 #endif
+
+/*
+ * Spins with an exponential backoff for a bounded while, then parks the thread
+ * in std::atomic::wait (a futex on Linux), so a preempted owner does not cost
+ * the waiters their whole timeslices. The state remembers whether anybody may
+ * be parked, so the unlock without waiters is a single exchange and no notify.
+ */
+class adaptive_mutex {
+	enum : std::uint32_t { UNLOCKED, LOCKED, PARKED };
+
+	// Rounds of PAUSE doubling up to this many before parking
+	constexpr static const std::uint32_t MAX_SPINS{1024};
+
+	std::atomic_uint32_t state{UNLOCKED};
+
+public:
+	void lock() noexcept {
+		std::uint32_t expected = UNLOCKED;
+		if (state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+			return;
+		}
+
+		for (std::uint32_t spins = 1; spins <= MAX_SPINS; spins *= 2) {
+			for (std::uint32_t i = 0; i < spins; ++i) {
+				active_mutex_detail::pause();
+			}
+			expected = UNLOCKED;
+			if (state.load(std::memory_order_relaxed) == UNLOCKED &&
+			    state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+				return;
+			}
+		}
+
+		// Whoever takes the lock from here on takes it as PARKED, not knowing whether others still sleep
+		while (state.exchange(PARKED, std::memory_order_acquire) != UNLOCKED) {
+			state.wait(PARKED, std::memory_order_relaxed);
+		}
+	}
+
+	bool try_lock() noexcept {
+		std::uint32_t expected = UNLOCKED;
+		return state.load(std::memory_order_relaxed) == UNLOCKED &&
+		       state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void unlock() noexcept {
+		if (state.exchange(UNLOCKED, std::memory_order_release) == PARKED) {
+			state.notify_one();
+		}
+	}
+};
+
+/*
+ * MCS queue lock. Waiters line up in the order they came and each of them
+ * spins on its own cache line until its predecessor hands the lock over, so
+ * nobody starves and the release touches a single waiter. The queue nodes come
+ * from a small per-thread pool, which allows holding several locks at once.
+ * A waiter that spun for long yields its timeslice, but the queue still stands
+ * behind a preempted waiter, so it is meant for threads with cores of their own.
+ */
+class mcs_mutex {
+	struct alignas(64) Node {
+		std::atomic<Node*> next{nullptr};
+		std::atomic_bool   locked{false};
+		bool               busy{false};
+		bool               pooled{true};
+	};
+
+	// Locks one thread holds at once before the nodes come from the heap
+	constexpr static const std::size_t POOL{8};
+	constexpr static const std::size_t YIELD_AFTER{1024};
+
+	std::atomic<Node*> tail{nullptr};
+	// Written by the owner after it got the lock, read by it in unlock
+	Node* owner{nullptr};
+
+	static auto acquireNode() -> Node* {
+		thread_local std::array<Node, POOL> pool;
+		for (auto& node : pool) {
+			if (!node.busy) {
+				node.busy = true;
+				return &node;
+			}
+		}
+		auto node    = new Node{};
+		node->busy   = true;
+		node->pooled = false;
+		return node;
+	}
+
+	static void releaseNode(Node* node) noexcept {
+		if (node->pooled) {
+			node->busy = false;
+		} else {
+			delete node;
+		}
+	}
+
+public:
+	void lock() {
+		Node* node = acquireNode();
+		node->next.store(nullptr, std::memory_order_relaxed);
+		node->locked.store(true, std::memory_order_relaxed);
+
+		if (Node* prev = tail.exchange(node, std::memory_order_acq_rel); prev != nullptr) {
+			prev->next.store(node, std::memory_order_release);
+			for (std::size_t spins = 0; node->locked.load(std::memory_order_acquire); ++spins) {
+				if (spins < YIELD_AFTER) {
+					active_mutex_detail::pause();
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		}
+		owner = node;
+	}
+
+	bool try_lock() {
+		if (tail.load(std::memory_order_relaxed) != nullptr) {
+			return false;
+		}
+		Node* node = acquireNode();
+		node->next.store(nullptr, std::memory_order_relaxed);
+		node->locked.store(true, std::memory_order_relaxed);
+
+		Node* expected = nullptr;
+		if (tail.compare_exchange_strong(expected, node, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+			owner = node;
+			return true;
+		}
+		releaseNode(node);
+		return false;
+	}
+
+	void unlock() noexcept {
+		Node* node = owner;
+		Node* next = node->next.load(std::memory_order_acquire);
+		if (next == nullptr) {
+			Node* expected = node;
+			if (tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+				releaseNode(node);
+				return;
+			}
+			// Somebody is just queueing behind us, wait until it links itself
+			while ((next = node->next.load(std::memory_order_acquire)) == nullptr) {
+				active_mutex_detail::pause();
+			}
+		}
+		next->locked.store(false, std::memory_order_release);
+		releaseNode(node);
+	}
+};
 #endif // _ZEENO_ACTIVE_MUTEX_HPP
@@ -1,79 +1,576 @@
 #pragma once
 
 #include "dummy_mutex.hpp"
+#include "statistics.hpp"
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
 #include <limits>
 #include <memory>
 #include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#	include <sys/mman.h>
+#	include <unistd.h>
+#endif
 
 namespace allocator {
 
-template<typename T, std::size_t BLOCK_SIZE = 4 * 1024 * 1024, template<typename...> typename Alloc = std::allocator, typename Mutex = dummy_mutex>
+/**
+ * @brief When block_adaptor hands completely free blocks back
+ * By default nothing is released automatically and the pool only shrinks on trim(). Once there are more than
+ * maxIdleBlocks completely free blocks, the pool releases them down to half of that, so it does not flap
+ * around the threshold. With decommit the blocks stay in the pool and only their pages are dropped by
+ * madvise(MADV_DONTNEED), which keeps the address range and the upstream allocation. Only the whole pages
+ * inside a block are dropped, so it is meant for anonymous memory; where madvise is missing, blocks are released instead.
+ */
+struct release_policy {
+	std::size_t maxIdleBlocks{std::numeric_limits<std::size_t>::max()};
+	bool        decommit{false};
+};
+
+// Every block guards its free list with the Mutex
+struct locked_free_list {};
+
+/*
+	Every block keeps its free list as a tagged Treiber stack and carves new cells with an atomic bump pointer, so threads
+	allocating from the current block and freeing into any block never wait for each other. The Mutex is taken only to
+	switch the current block. Another thread may still be reading a block it saw as current a moment ago, so blocks are
+	never handed back to Alloc while the pool lives; trim() and the release_policy always decommit them instead.
+*/
+struct lock_free_list {};
+
+/*
+	Blocks guard their free lists with the Mutex like locked_free_list, but only the owner of the pool, the thread that
+	allocated from it last, frees through them. Any other thread pushes its cells to an atomic queue of their block
+	without taking a lock, and announces the block to the pool when the queue was empty. The next allocation of the owner,
+	which holds the ControlBlock lock anyway, gives the queued cells of all announced blocks back in bulk and applies
+	the release_policy. Meant for cells allocated on one thread and freed on others, the freeing threads then never
+	wait for the allocating one.
+*/
+struct remote_free_queue {};
+
+namespace detail {
+// Pools of all the block_adaptors rebound from one another, one pool per type. They live as long as any adaptor of the family.
+template<typename Mutex>
+struct pool_family : Mutex {
+	std::vector<std::pair<const void*, std::shared_ptr<void>>> pools;
+};
+
+// Returns the pool of the family for the type whose key is given, creating it from args the first time
+template<typename Pool, typename Mutex, typename... Args>
+auto family_pool(const std::shared_ptr<pool_family<Mutex>>& family, const void* key, Args&&... args) -> std::shared_ptr<Pool> {
+	std::scoped_lock lock{*family};
+	auto&            pools = family->pools;
+	auto             it    = std::find_if(pools.begin(), pools.end(), [key](const auto& pool) { return pool.first == key; });
+	if (it == pools.end()) {
+		it = pools.emplace(pools.end(), key, std::make_shared<Pool>(family.get(), std::forward<Args>(args)...));
+	}
+	return std::shared_ptr<Pool>{family, static_cast<Pool*>(it->second.get())};
+}
+} // namespace detail
+
+/**
+ * @brief Fixed size cell allocator on top of big blocks requested from Alloc
+ * MAGAZINE_SIZE enables a per-thread cache of free cells in front of the shared blocks. Each thread keeps up to
+ * 2 * MAGAZINE_SIZE cells per allocator, refills MAGAZINE_SIZE cells at once when it runs dry and flushes MAGAZINE_SIZE cells
+ * when it overflows, so a balanced allocate/deallocate pair never touches memory shared with other threads.
+ * Cells held by a thread are returned to the allocator when the thread exits.
+ * Completely free blocks are returned to Alloc by trim() or automatically according to the release_policy.
+ * FreeList selects how the blocks synchronize, locked_free_list, lock_free_list or remote_free_queue.
+ * Arrays of n elements are served as runs of contiguous cells rounded up to a power of two, up to MAX_RUN cells.
+ * Bigger arrays are requested from Alloc directly.
+ * Rebound adaptors share a family with the original, each type has its own pool in it and all of them compare equal.
+ * With the statistics policy every pool counts its allocations, blocks and contention on its lock, see stats().
+ */
+template<
+    typename T,
+    std::size_t BLOCK_SIZE               = 4 * 1024 * 1024,
+    template<typename...> typename Alloc = std::allocator,
+    typename Mutex                       = dummy_mutex,
+    std::size_t MAGAZINE_SIZE            = 0,
+    typename FreeList                    = locked_free_list,
+    typename Statistics                  = no_statistics>
 struct block_adaptor {
-	constexpr static const std::size_t ELEM_SIZE{std::max(sizeof(T), sizeof(void*))};
+	template<typename, std::size_t, template<typename...> typename, typename, std::size_t, typename, typename>
+	friend struct block_adaptor;
+
+	// Cells hold a T or a free list link, each aligned for both. Blocks are aligned by hand beyond what Alloc guarantees.
+	constexpr static const std::size_t ALIGNMENT{std::max(alignof(T), alignof(void*))};
+	constexpr static const std::size_t ELEM_SIZE{(std::max(sizeof(T), sizeof(void*)) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT};
+	constexpr static const std::size_t PADDING{ALIGNMENT > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? ALIGNMENT - 1 : 0};
+	constexpr static const std::size_t CELLS{BLOCK_SIZE / ELEM_SIZE};
+	constexpr static const bool        LOCK_FREE{std::is_same_v<FreeList, lock_free_list>};
+	constexpr static const bool        REMOTE_FREE{std::is_same_v<FreeList, remote_free_queue>};
+	constexpr static const std::size_t MAX_RUN{std::min(256UZ, std::bit_floor(std::max(CELLS / 8, 1UZ)))};
+	constexpr static const std::size_t RUN_CLASSES{std::bit_width(MAX_RUN) - 1};
+
+	static_assert(BLOCK_SIZE >= ELEM_SIZE, "block can not hold a single element");
+	static_assert(!LOCK_FREE || CELLS < (1ULL << 32), "lock_free_list addresses cells by 32-bit indices");
+
+	/*
+		Cells that were never handed out are carved from the untouched end of the block by bumping _carved,
+		only the cells that came back are threaded into the intrusive free list. A new block therefore does not
+		touch any of its pages, and the pages are faulted in one by one as the cells are really used.
+		_state changes only under both the ControlBlock and the Block lock, _idle only under the ControlBlock lock.
 
+		With lock_free_list the Block lock is never taken. _free then holds the 1-based index of the first free cell in
+		the low 32 bits, an ABA tag above it and the FULL flag in the top bit, and every free cell holds the index of the next one.
+		A block is marked FULL only while it has no free cell, the deallocation that clears the flag puts it back to the partial list.
+
+		Runs of 2 << cls cells are carved the same way, returned runs are kept in _runs[cls] for the next run of that size.
+		The run lists are only touched under the ControlBlock lock (and the Block lock without lock_free_list). A block
+		with returned runs of a class is linked through _prevRun[cls] and _nextRun[cls], whatever list it is on otherwise.
+
+		With remote_free_queue the cells freed by other threads wait in _remote, still live, and a block with queued cells
+		is announced to the ControlBlock through _nextRemote by the free that found the queue empty.
+	*/
 	struct Block : Mutex {
 		using byte_type       = std::byte;
 		using byte_alloc_type = Alloc<byte_type>;
+		using free_type       = std::conditional_t<LOCK_FREE, std::atomic_uint_least64_t, void*>;
+		using count_type      = std::conditional_t<LOCK_FREE, std::atomic_size_t, std::size_t>;
+		using run_list_type   = std::array<void*, RUN_CLASSES>;
+		using block_list_type = std::array<Block*, RUN_CLASSES>;
+
+		enum class State { current, partial, full };
+
+		struct Given {
+			bool wasFull{false};
+			bool nowIdle{false};
+		};
 
-		byte_type*      _data{nullptr};
-		void*           _free{nullptr};
-		Block*          _nextBlock{nullptr};
-		byte_alloc_type _alloc{};
+		constexpr static const std::uint_least64_t INDEX_MASK{0xFFFF'FFFFULL};
+		constexpr static const std::uint_least64_t FULL{1ULL << 63};
+		constexpr static const std::uint_least64_t TAG_MASK{~INDEX_MASK & ~FULL};
+
+		byte_type*         _raw{nullptr};
+		byte_type*         _data{nullptr};
+		free_type          _free{};
+		count_type         _carved{0};
+		count_type         _live{0};
+		run_list_type      _runs{};
+		block_list_type    _prevRun{};
+		block_list_type    _nextRun{};
+		State              _state{State::current};
+		bool               _idle{false};
+		Block*             _prevBlock{nullptr};
+		Block*             _nextBlock{nullptr};
+		Block*             _prevPartial{nullptr};
+		Block*             _nextPartial{nullptr};
+		std::atomic<void*> _remote{nullptr};
+		Block*             _nextRemote{nullptr};
+		byte_alloc_type    _alloc{};
 
 		explicit Block(byte_alloc_type alloc) : _alloc{alloc} {
 			std::scoped_lock lock{*this};
-			_data = std::allocator_traits<byte_alloc_type>::allocate(_alloc, BLOCK_SIZE);
-
-			std::size_t i{0};
-			for (; i <= BLOCK_SIZE - ELEM_SIZE; i += ELEM_SIZE) {
-				*reinterpret_cast<void**>(_data + i) = static_cast<void*>(_data + i + ELEM_SIZE);
-			}
-			*reinterpret_cast<void**>(_data + i - ELEM_SIZE) = nullptr;
-			_free                                            = _data;
+			_raw  = std::allocator_traits<byte_alloc_type>::allocate(_alloc, BLOCK_SIZE + PADDING);
+			_data = _raw + (ALIGNMENT - reinterpret_cast<std::uintptr_t>(_raw) % ALIGNMENT) % ALIGNMENT;
 		}
 
 		Block(const Block&)                    = delete;
 		auto operator=(const Block&) -> Block& = delete;
-		Block(Block&&)                         = default;
-		auto operator=(Block&&) -> Block&      = default;
+		Block(Block&&)                         = delete;
+		auto operator=(Block&&) -> Block&      = delete;
 
-		auto take() -> void* {
-			std::scoped_lock lock{*this};
-			if (_free == nullptr) {
-				return nullptr;
+		// Takes up to count cells under a single lock, returns the number of cells stored to out
+		// Returned cells are reused first, they are likely still in the cache and their pages are already mapped
+		// A block that can not satisfy the request is marked as full, the ControlBlock then stops allocating from it
+		auto take(void** out, std::size_t count) -> std::size_t {
+			if constexpr (LOCK_FREE) {
+				return takeLockFree(out, count);
+			} else {
+				std::scoped_lock lock{*this};
+				std::size_t      taken{0};
+				for (; taken < count && _free != nullptr; ++taken) {
+					out[taken] = _free;
+					_free      = *static_cast<void**>(_free);
+				}
+				for (; taken < count && _carved + ELEM_SIZE <= BLOCK_SIZE; ++taken) {
+					out[taken] = _data + _carved;
+					_carved += ELEM_SIZE;
+				}
+				if (taken < count) {
+					_state = State::full;
+				}
+				_live += taken;
+				return taken;
 			}
-			void* p = _free;
-			_free   = *static_cast<void**>(_free);
-			return p;
 		}
 
-		auto give(void* p) -> bool {
+		// Returns count cells that all belong to this block under a single lock
+		// Refuses the cells of a full block, the caller has to put the block back to the partial list first.
+		// With keepLast it also refuses the last live cells of a partial block, so the caller can count it as idle.
+		auto give(void* const* cells, std::size_t count, bool keepLast) -> bool {
 			std::scoped_lock lock{*this};
-			if (p < _data || p >= _data + BLOCK_SIZE) {
+			if (_state == State::full || (keepLast && _state == State::partial && _live == count)) {
 				return false;
 			}
-			*static_cast<void**>(p) = _free;
-			_free                   = p;
+			push(cells, count);
 			return true;
 		}
 
+		// Same as give, but the caller already holds the lock
+		void push(void* const* cells, std::size_t count) {
+			for (std::size_t i{0}; i < count; ++i) {
+				*static_cast<void**>(cells[i]) = _free;
+				_free                          = cells[i];
+			}
+			_live -= count;
+		}
+
+		// Queues the chain of cells from first to last freed by another thread. Returns true when the queue was empty,
+		// the caller then announces the block to the ControlBlock.
+		auto queue(void* first, void* last) noexcept -> bool {
+			auto head = _remote.load(std::memory_order_relaxed);
+			do {
+				*static_cast<void**>(last) = head;
+			} while (!_remote.compare_exchange_weak(head, first, std::memory_order_acq_rel, std::memory_order_relaxed));
+			return head == nullptr;
+		}
+
+		// Moves all the queued cells to the free list, the caller holds the lock
+		void collect() {
+			for (auto cell = _remote.exchange(nullptr, std::memory_order_acq_rel); cell != nullptr;) {
+				auto next = *static_cast<void**>(cell);
+				push(&cell, 1);
+				cell = next;
+			}
+		}
+
+		// Takes a run of 2 << cls contiguous cells, a returned run first. Does not mark the block as full when it fails,
+		// single cells may still be left. The caller holds the ControlBlock lock.
+		auto takeRun(std::size_t cls) -> void* {
+			const auto              cells = 2UZ << cls;
+			std::unique_lock<Block> lock{*this, std::defer_lock};
+			if constexpr (!LOCK_FREE) {
+				lock.lock();
+			}
+
+			void* run = _runs[cls];
+			if (run != nullptr) {
+				_runs[cls] = *static_cast<void**>(run);
+			} else if constexpr (LOCK_FREE) {
+				// Single cells are carved concurrently, the run must not reach over the end of the block
+				auto carved = _carved.load();
+				do {
+					if (carved + cells * ELEM_SIZE > BLOCK_SIZE) {
+						return nullptr;
+					}
+				} while (!_carved.compare_exchange_weak(carved, carved + cells * ELEM_SIZE));
+				run = _data + carved;
+			} else {
+				if (_carved + cells * ELEM_SIZE > BLOCK_SIZE) {
+					return nullptr;
+				}
+				run = _data + _carved;
+				_carved += cells * ELEM_SIZE;
+			}
+			_live += cells;
+			return run;
+		}
+
+		// Returns a run taken by takeRun, the caller holds the same locks. Returns true when no live cell is left.
+		auto pushRun(void* run, std::size_t cls) -> bool {
+			*static_cast<void**>(run) = _runs[cls];
+			_runs[cls]                = run;
+			return (_live -= 2UZ << cls) == 0;
+		}
+
+		// Drops the pages of a completely free block and starts carving it from the beginning again
+		auto decommit() -> bool {
+#if __has_include(<sys/mman.h>)
+			if constexpr (LOCK_FREE) {
+				return decommitLockFree();
+			} else {
+				std::scoped_lock lock{*this};
+				if (!dropPages()) {
+					return false;
+				}
+				_free   = nullptr;
+				_carved = 0;
+				_runs   = {};
+				return true;
+			}
+#else
+			return false;
+#endif
+		}
+
+		// Pushes count cells of this block at once, never refuses them
+		auto giveLockFree(void* const* cells, std::size_t count) -> Given {
+			for (std::size_t i{0}; i + 1 < count; ++i) {
+				next(cells[i]).store(index(cells[i + 1]), std::memory_order_relaxed);
+			}
+			auto head = _free.load(std::memory_order_relaxed);
+			do {
+				next(cells[count - 1]).store(static_cast<std::uint_least32_t>(head & INDEX_MASK), std::memory_order_relaxed);
+			} while (!_free.compare_exchange_weak(head, retag(head, index(cells[0])), std::memory_order_release, std::memory_order_relaxed));
+			return {(head & FULL) != 0, _live.fetch_sub(count) == count};
+		}
+
+		// Marks the exhausted current block as FULL, fails if a cell came back in the meantime. Called under the ControlBlock lock.
+		// Returned runs of a FULL block are still found through the firstRun lists of the ControlBlock.
+		auto retire() -> bool {
+			if (_carved.load() + ELEM_SIZE <= BLOCK_SIZE) {
+				return false;
+			}
+			auto head = _free.load();
+			return (head & INDEX_MASK) == 0 && _free.compare_exchange_strong(head, retag(head, 0) | FULL);
+		}
+
 		~Block() {
 			std::scoped_lock lock{*this};
-			std::allocator_traits<byte_alloc_type>::deallocate(_alloc, _data, BLOCK_SIZE);
+			std::allocator_traits<byte_alloc_type>::deallocate(_alloc, _raw, BLOCK_SIZE + PADDING);
 		}
+
+	private:
+		auto cell(std::uint_least32_t index) const -> void* {
+			return _data + (index - 1) * ELEM_SIZE;
+		}
+
+		auto index(void* cell) const -> std::uint_least32_t {
+			return static_cast<std::uint_least32_t>((static_cast<byte_type*>(cell) - _data) / ELEM_SIZE + 1);
+		}
+
+		static auto next(void* cell) -> std::atomic_ref<std::uint_least32_t> {
+			return std::atomic_ref<std::uint_least32_t>{*static_cast<std::uint_least32_t*>(cell)};
+		}
+
+		static auto retag(std::uint_least64_t head, std::uint_least32_t index) -> std::uint_least64_t {
+			return (((head & TAG_MASK) + INDEX_MASK + 1) & TAG_MASK) | index;
+		}
+
+		/*
+			The cells are announced in _live before the lists are touched and decommit() empties the lists before it
+			checks _live, both with sequentially consistent operations, so one of the two always sees the other.
+		*/
+		auto takeLockFree(void** out, std::size_t count) -> std::size_t {
+			_live.fetch_add(count);
+
+			std::size_t taken{0};
+			auto        head = _free.load();
+			while ((head & INDEX_MASK) != 0) {
+				// A cell popped by another thread meanwhile may already hold user data, then the walk reads garbage
+				// and the tag makes the CAS fail. The memory itself stays mapped, blocks are never released.
+				auto        first = static_cast<std::uint_least32_t>(head & INDEX_MASK);
+				std::size_t n{0};
+				while (n < count && first != 0 && first <= CELLS) {
+					out[n++] = cell(first);
+					first    = next(cell(first)).load(std::memory_order_relaxed);
+				}
+				if (first > CELLS) {
+					head = _free.load();
+					continue;
+				}
+				if (_free.compare_exchange_weak(head, retag(head, first))) {
+					taken = n;
+					break;
+				}
+			}
+
+			if (taken < count && _carved.load(std::memory_order_relaxed) < BLOCK_SIZE) {
+				for (auto offset = _carved.fetch_add((count - taken) * ELEM_SIZE); taken < count && offset + ELEM_SIZE <= BLOCK_SIZE; offset += ELEM_SIZE) {
+					out[taken++] = _data + offset;
+				}
+			}
+
+			if (taken < count) {
+				_live.fetch_sub(count - taken);
+			}
+			return taken;
+		}
+
+#if __has_include(<sys/mman.h>)
+		auto dropPages() -> bool {
+			const auto page  = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+			const auto begin = (reinterpret_cast<std::uintptr_t>(_data) + page - 1) / page * page;
+			const auto end   = (reinterpret_cast<std::uintptr_t>(_data) + BLOCK_SIZE) / page * page;
+			return begin >= end || madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED) == 0;
+		}
+
+		// Empties the block first, so that a late thread can not take a cell while the pages are being dropped
+		auto decommitLockFree() -> bool {
+			auto head = _free.load();
+			while (!_free.compare_exchange_weak(head, retag(head, 0) | (head & FULL))) {
+			}
+			const auto carved = _carved.exchange(BLOCK_SIZE);
+
+			if (_live.load() != 0 || !dropPages()) {
+				// Somebody is taking cells right now, put everything back the way it was
+				if (auto first = static_cast<std::uint_least32_t>(head & INDEX_MASK); first != 0) {
+					auto last = first;
+					while (auto following = next(cell(last)).load(std::memory_order_relaxed)) {
+						last = following;
+					}
+					auto current = _free.load();
+					do {
+						next(cell(last)).store(static_cast<std::uint_least32_t>(current & INDEX_MASK), std::memory_order_relaxed);
+					} while (!_free.compare_exchange_weak(current, retag(current, first) | (current & FULL)));
+				}
+				_carved.store(carved);
+				return false;
+			}
+
+			_carved.store(0);
+			_runs = {};
+			return true;
+		}
+#endif
 	};
 
-	using value_type = T;
-	using alloc_type = Alloc<Block>;
+	/*
+		Radix tree from address / BLOCK_SIZE to the Block starting in that BLOCK_SIZE slice of the address space.
+		Every block is exactly BLOCK_SIZE long, so an address belongs either to the block starting in its own slice,
+		or to the one starting in the slice before. Lookups are lock-free, nodes are only added under the ControlBlock lock.
+		Slots keep the block start next to the block, the lookup must not touch a neighbouring block that is being released.
+	*/
+	struct BlockMap {
+		constexpr static const std::size_t ADDRESS_BITS{std::min(48, std::numeric_limits<std::uintptr_t>::digits)};
+		constexpr static const std::size_t KEY_BITS{ADDRESS_BITS - (std::bit_width(BLOCK_SIZE) - 1)};
+		constexpr static const std::size_t LEAF_BITS{KEY_BITS / 3};
+		constexpr static const std::size_t MID_BITS{KEY_BITS / 3};
+		constexpr static const std::size_t ROOT_BITS{KEY_BITS - LEAF_BITS - MID_BITS};
+
+		struct Slot {
+			std::atomic<Block*>         block{nullptr};
+			std::atomic<std::uintptr_t> begin{0};
+		};
 
-	struct ControlBlock : Mutex {
-		alloc_type alloc{};
-		Block*     firstBlock{};
+		using Leaf = std::array<Slot, 1UZ << LEAF_BITS>;
+		using Mid  = std::array<std::atomic<Leaf*>, 1UZ << MID_BITS>;
+
+		std::array<std::atomic<Mid*>, 1UZ << ROOT_BITS> root{};
+
+		BlockMap()                                   = default;
+		BlockMap(const BlockMap&)                    = delete;
+		BlockMap(BlockMap&&)                         = delete;
+		auto operator=(const BlockMap&) -> BlockMap& = delete;
+		auto operator=(BlockMap&&) -> BlockMap&      = delete;
+
+		~BlockMap() {
+			for (auto& mid : root) {
+				if (auto m = mid.load(std::memory_order_relaxed); m) {
+					for (auto& leaf : *m) {
+						delete leaf.load(std::memory_order_relaxed);
+					}
+					delete m;
+				}
+			}
+		}
 
-		explicit ControlBlock(alloc_type&& alloc) : alloc{alloc} {
+		[[nodiscard]] auto find(const void* p) const noexcept -> Block* {
+			const auto address = reinterpret_cast<std::uintptr_t>(p);
+			const auto key     = address / BLOCK_SIZE;
+			for (auto k : {key, key - 1}) {
+				if (auto slot = at(k); slot) {
+					if (auto block = slot->block.load(std::memory_order_acquire); block) {
+						if (address - slot->begin.load(std::memory_order_acquire) < BLOCK_SIZE) {
+							return block;
+						}
+					}
+				}
+			}
+			return nullptr;
+		}
+
+		// Must be called under the ControlBlock lock, returns false if the block lies outside of the mapped address space
+		[[nodiscard]] auto insert(Block* block) -> bool {
+			const auto key = reinterpret_cast<std::uintptr_t>(block->_data) / BLOCK_SIZE;
+			if (key >> KEY_BITS) {
+				return false;
+			}
+
+			auto& midSlot = root[key >> (MID_BITS + LEAF_BITS)];
+			auto  mid     = midSlot.load(std::memory_order_relaxed);
+			if (mid == nullptr) {
+				mid = new Mid{};
+				midSlot.store(mid, std::memory_order_release);
+			}
+
+			auto& leafSlot = (*mid)[(key >> LEAF_BITS) & ((1UZ << MID_BITS) - 1)];
+			auto  leaf     = leafSlot.load(std::memory_order_relaxed);
+			if (leaf == nullptr) {
+				leaf = new Leaf{};
+				leafSlot.store(leaf, std::memory_order_release);
+			}
+
+			auto& slot = (*leaf)[key & ((1UZ << LEAF_BITS) - 1)];
+			slot.begin.store(reinterpret_cast<std::uintptr_t>(block->_data), std::memory_order_release);
+			slot.block.store(block, std::memory_order_release);
+			return true;
+		}
+
+		// Must be called under the ControlBlock lock
+		void erase(Block* block) {
+			auto slot = at(reinterpret_cast<std::uintptr_t>(block->_data) / BLOCK_SIZE);
+			slot->block.store(nullptr, std::memory_order_release);
+			slot->begin.store(0, std::memory_order_release);
+		}
+
+	private:
+		[[nodiscard]] auto at(std::uintptr_t key) const noexcept -> Slot* {
+			if (key >> KEY_BITS) {
+				return nullptr;
+			}
+			auto mid = root[key >> (MID_BITS + LEAF_BITS)].load(std::memory_order_acquire);
+			if (mid == nullptr) {
+				return nullptr;
+			}
+			auto leaf = (*mid)[(key >> LEAF_BITS) & ((1UZ << MID_BITS) - 1)].load(std::memory_order_acquire);
+			if (leaf == nullptr) {
+				return nullptr;
+			}
+			return &(*leaf)[key & ((1UZ << LEAF_BITS) - 1)];
+		}
+	};
+
+	using value_type  = T;
+	using alloc_type  = Alloc<Block>;
+	using family_type = detail::pool_family<Mutex>;
+
+	template<typename U>
+	struct rebind {
+		using other = block_adaptor<U, BLOCK_SIZE, Alloc, Mutex, MAGAZINE_SIZE, FreeList, Statistics>;
+	};
+
+	/*
+		Allocations are served from the current block only. Once it is exhausted it is marked as full and forgotten,
+		until a deallocation brings it back to the list of partial blocks. Allocation therefore never visits a full block,
+		no matter how many of them the pool has. Runs are taken from firstRun[cls], the blocks holding returned runs of
+		that class, before any is carved. All the lists are guarded by the ControlBlock lock.
+		A partial block without live cells is idle, and idle blocks are what the release_policy hands back to Alloc.
+		With lock_free_list the current block is read without the lock, so it is only ever changed with release semantics.
+	*/
+	struct ControlBlock : detail::counted_mutex<Mutex, Statistics> {
+		alloc_type                      alloc{};
+		Block*                          firstBlock{};
+		std::atomic<Block*>             current{};
+		Block*                          firstPartial{};
+		std::array<Block*, RUN_CLASSES> firstRun{};
+		std::size_t                     idleBlocks{0};
+		BlockMap                        blocks;
+		const release_policy            policy;
+		family_type* const              family;
+		std::uint_least64_t             id{nextId++};
+
+		[[no_unique_address]] detail::counters<Statistics> stats;
+
+		// Blocks with cells queued by other threads under remote_free_queue, and the thread whose frees are not queued
+		alignas(64) std::atomic<Block*> remote{nullptr};
+		std::atomic<std::thread::id>    owner{};
+
+		// The address identifies the pool of this type within a family
+		inline static const char familyKey{};
+
+		ControlBlock(family_type* family, alloc_type&& alloc, release_policy policy) : alloc{alloc}, policy{policy}, family{family} {
 		}
 
 		~ControlBlock() {
@@ -85,9 +582,79 @@ struct block_adaptor {
 				firstBlock = nextBlock;
 			}
 		}
+
+		void pushPartial(Block* block) {
+			block->_prevPartial = nullptr;
+			block->_nextPartial = firstPartial;
+			if (firstPartial) {
+				firstPartial->_prevPartial = block;
+			}
+			firstPartial = block;
+		}
+
+		void unlinkPartial(Block* block) {
+			if (block->_prevPartial) {
+				block->_prevPartial->_nextPartial = block->_nextPartial;
+			} else {
+				firstPartial = block->_nextPartial;
+			}
+			if (block->_nextPartial) {
+				block->_nextPartial->_prevPartial = block->_prevPartial;
+			}
+			block->_prevPartial = nullptr;
+			block->_nextPartial = nullptr;
+		}
+
+		void pushRun(Block* block, std::size_t cls) {
+			block->_prevRun[cls] = nullptr;
+			block->_nextRun[cls] = firstRun[cls];
+			if (firstRun[cls]) {
+				firstRun[cls]->_prevRun[cls] = block;
+			}
+			firstRun[cls] = block;
+		}
+
+		void unlinkRun(Block* block, std::size_t cls) {
+			if (block->_prevRun[cls]) {
+				block->_prevRun[cls]->_nextRun[cls] = block->_nextRun[cls];
+			} else {
+				firstRun[cls] = block->_nextRun[cls];
+			}
+			if (block->_nextRun[cls]) {
+				block->_nextRun[cls]->_prevRun[cls] = block->_prevRun[cls];
+			}
+			block->_prevRun[cls] = nullptr;
+			block->_nextRun[cls] = nullptr;
+		}
+
+		// Once the runs of the block are dropped along with its pages or the block itself
+		void unlinkRuns(Block* block) {
+			for (std::size_t cls{0}; cls < RUN_CLASSES; ++cls) {
+				if (firstRun[cls] == block || block->_prevRun[cls] != nullptr) {
+					unlinkRun(block, cls);
+				}
+			}
+		}
+
+	private:
+		// Ids are never reused, so a thread cache can not mistake a new allocator for a destroyed one at the same address
+		inline static std::atomic_uint_least64_t nextId{1};
 	};
 
-	block_adaptor(alloc_type&& alloc = alloc_type()) : _controlBlock{std::make_shared<ControlBlock>(std::move(alloc))} {
+	block_adaptor(alloc_type&& alloc = alloc_type(), release_policy policy = {})
+	    : _controlBlock{detail::family_pool<ControlBlock>(std::make_shared<family_type>(), &ControlBlock::familyKey, std::move(alloc), policy)}
+	    , _id{_controlBlock->id} {
+	}
+
+	// Uses the pool for T of the family of other, with the same Alloc and release_policy
+	template<typename U>
+	block_adaptor(const block_adaptor<U, BLOCK_SIZE, Alloc, Mutex, MAGAZINE_SIZE, FreeList, Statistics>& other)
+	    : _controlBlock{detail::family_pool<ControlBlock>(
+	          std::shared_ptr<family_type>{other._controlBlock, other._controlBlock->family},
+	          &ControlBlock::familyKey,
+	          alloc_type{other._controlBlock->alloc},
+	          other._controlBlock->policy)}
+	    , _id{_controlBlock->id} {
 	}
 
 	block_adaptor(const block_adaptor&)                    = default;
@@ -99,73 +666,540 @@ struct block_adaptor {
 	}
 
 	[[nodiscard]] auto allocate(std::size_t n) -> value_type* {
-		if (n - 1) {
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
 			throw std::bad_array_new_length();
 		}
+		value_type* p{nullptr};
+		if (const auto cells = cellsFor(n); cells > MAX_RUN) {
+			Alloc<value_type> alloc{_controlBlock->alloc};
+			p = std::allocator_traits<Alloc<value_type>>::allocate(alloc, n);
+			_controlBlock->stats.reserved(n * sizeof(T), false);
+		} else if (cells > 1) {
+			p = static_cast<value_type*>(allocateRun(runClass(cells)));
+		} else if constexpr (MAGAZINE_SIZE > 0) {
+			auto& magazine = threadMagazine();
+			if (magazine.count == 0) {
+				magazine.count = allocateShared(magazine.cells.data(), MAGAZINE_SIZE);
+			}
+			p = static_cast<value_type*>(magazine.cells[--magazine.count]);
+		} else {
+			void* cell{nullptr};
+			allocateShared(&cell, 1);
+			p = static_cast<value_type*>(cell);
+		}
+		_controlBlock->stats.allocated(n * sizeof(T));
+		return p;
+	}
 
-		Block* block;
-		{
-			std::scoped_lock lock{*_controlBlock};
-			block = _controlBlock->firstBlock;
+	void deallocate(value_type* p, std::size_t n) noexcept {
+		_controlBlock->stats.deallocated(n * sizeof(T));
+		if (const auto cells = cellsFor(n); cells > MAX_RUN) {
+			Alloc<value_type> alloc{_controlBlock->alloc};
+			std::allocator_traits<Alloc<value_type>>::deallocate(alloc, p, n);
+			_controlBlock->stats.released(n * sizeof(T), false);
+			return;
+		} else if (cells > 1) {
+			deallocateRun(p, runClass(cells));
+			return;
+		}
+
+		if constexpr (MAGAZINE_SIZE > 0) {
+			auto& magazine = threadMagazine();
+			if (magazine.count == magazine.cells.size()) {
+				// Return the oldest half, the most recently freed cells are the ones still hot in this core's cache
+				deallocateShared(magazine.cells.data(), MAGAZINE_SIZE);
+				std::move(magazine.cells.begin() + MAGAZINE_SIZE, magazine.cells.end(), magazine.cells.begin());
+				magazine.count -= MAGAZINE_SIZE;
+			}
+			magazine.cells[magazine.count++] = p;
+		} else {
+			void* cell{p};
+			deallocateShared(&cell, 1);
 		}
-		while (block) {
-			if (auto p = static_cast<value_type*>(block->take()); p) {
-				return p;
+	}
+
+	// Whether p, allocated as n elements, comes from this pool. Cells are found lock-free in the BlockMap,
+	// bigger arrays belong to Alloc, which is asked in turn if it can tell.
+	[[nodiscard]] auto owns(const value_type* p, std::size_t n) const -> bool {
+		if (cellsFor(n) > MAX_RUN) {
+			if constexpr (requires(const Alloc<value_type>& alloc) { alloc.owns(p, n); }) {
+				return Alloc<value_type>{_controlBlock->alloc}.owns(p, n);
+			} else {
+				return false;
 			}
-			{
-				std::scoped_lock lock{*block};
-				block = block->_nextBlock;
+		}
+		return _controlBlock->blocks.find(p) != nullptr;
+	}
+
+	// Hands all completely free blocks back to Alloc (or decommits them), returns the number of released blocks
+	// Cells cached by the calling thread are returned first, the caches of other threads keep their blocks alive
+	auto trim() -> std::size_t {
+		if constexpr (MAGAZINE_SIZE > 0) {
+			auto& magazine = threadMagazine();
+			deallocateShared(magazine.cells.data(), magazine.count);
+			magazine.count = 0;
+		}
+
+		std::scoped_lock lock{*_controlBlock};
+		if constexpr (REMOTE_FREE) {
+			collectRemote();
+		}
+		auto released = releaseIdle(0);
+		if (auto block = _controlBlock->current.load(std::memory_order_relaxed); block && isIdle(block) && releaseBlock(block)) {
+			++released;
+		}
+		return released;
+	}
+
+	// Counters of the pool of this type, all zero with no_statistics
+	[[nodiscard]] auto stats() const -> allocator_stats {
+		auto snapshot           = _controlBlock->stats.snapshot();
+		snapshot.contendedLocks = _controlBlock->contended();
+		return snapshot;
+	}
+
+private:
+	struct Magazine {
+		std::uint_least64_t                  id{0};
+		std::weak_ptr<ControlBlock>          owner;
+		std::size_t                          count{0};
+		std::array<void*, 2 * MAGAZINE_SIZE> cells{};
+	};
+
+	struct ThreadCache {
+		std::vector<std::unique_ptr<Magazine>> magazines;
+		Magazine*                              last{nullptr};
+
+		ThreadCache()                                      = default;
+		ThreadCache(const ThreadCache&)                    = delete;
+		ThreadCache(ThreadCache&&)                         = delete;
+		auto operator=(const ThreadCache&) -> ThreadCache& = delete;
+		auto operator=(ThreadCache&&) -> ThreadCache&      = delete;
+
+		~ThreadCache() {
+			for (auto& magazine : magazines) {
+				if (auto controlBlock = magazine->owner.lock(); controlBlock) {
+					block_adaptor{controlBlock}.deallocateShared(magazine->cells.data(), magazine->count);
+				}
 			}
 		}
+	};
 
-		block = std::allocator_traits<alloc_type>::allocate(_controlBlock->alloc, 1);
-		std::allocator_traits<alloc_type>::construct(_controlBlock->alloc, block, Alloc<std::byte>{_controlBlock->alloc});
-		{
-			std::scoped_lock lock{*_controlBlock, *block};
-			block->_nextBlock         = _controlBlock->firstBlock;
-			_controlBlock->firstBlock = block;
+	explicit block_adaptor(std::shared_ptr<ControlBlock> controlBlock) : _controlBlock{std::move(controlBlock)}, _id{_controlBlock->id} {
+	}
+
+	auto threadMagazine() -> Magazine& {
+		thread_local ThreadCache cache;
+		if (cache.last != nullptr && cache.last->id == _id) {
+			return *cache.last;
 		}
+		return findMagazine(cache);
+	}
 
-		if (auto p = static_cast<value_type*>(block->take()); p) {
-			return p;
+	auto findMagazine(ThreadCache& cache) -> Magazine& {
+		auto& magazines = cache.magazines;
+		for (auto& magazine : magazines) {
+			if (magazine->id == _id) {
+				cache.last = magazine.get();
+				return *magazine;
+			}
 		}
 
-		throw std::bad_alloc();
+		// Magazines of destroyed allocators only hold dangling cells, drop them before adding a new one
+		std::erase_if(magazines, [](const auto& magazine) { return magazine->owner.expired(); });
+		auto& magazine  = magazines.emplace_back(std::make_unique<Magazine>());
+		magazine->id    = _id;
+		magazine->owner = _controlBlock;
+		cache.last      = magazine.get();
+		return *magazine;
 	}
 
-	void deallocate(value_type* p, std::size_t n) noexcept {
-		if (n - 1) {
-			return;
+	// Number of cells holding n elements, small arrays of small types still fit a single cell
+	static constexpr auto cellsFor(std::size_t n) -> std::size_t {
+		return std::max((n * sizeof(T) + ELEM_SIZE - 1) / ELEM_SIZE, 1UZ);
+	}
+
+	// Runs of 2 cells are class 0, runs of 3 or 4 cells class 1 and so on
+	static constexpr auto runClass(std::size_t cells) -> std::size_t {
+		return std::bit_width(cells - 1) - 1;
+	}
+
+	// Returned runs are reused first, then runs are carved from the current block or a partial one with room left,
+	// a decommitted one among them, otherwise a new block becomes current
+	auto allocateRun(std::size_t cls) -> void* {
+		std::scoped_lock lock{*_controlBlock};
+		if (auto block = _controlBlock->firstRun[cls]; block) {
+			auto run = block->takeRun(cls);
+			if (block->_runs[cls] == nullptr) {
+				_controlBlock->unlinkRun(block, cls);
+			}
+			if (block->_idle) {
+				block->_idle = false;
+				--_controlBlock->idleBlocks;
+			}
+			return run;
 		}
 
-		Block* block;
-		{
+		auto current = _controlBlock->current.load(std::memory_order_relaxed);
+		if (current) {
+			if (auto run = current->takeRun(cls); run) {
+				return run;
+			}
+		}
+		for (auto partial = _controlBlock->firstPartial; partial; partial = partial->_nextPartial) {
+			if (auto run = partial->takeRun(cls); run) {
+				if (partial->_idle) {
+					partial->_idle = false;
+					--_controlBlock->idleBlocks;
+				}
+				return run;
+			}
+		}
+
+		auto block = createBlock();
+		auto run   = block->takeRun(cls);
+		if (current) {
+			if constexpr (!LOCK_FREE) {
+				std::scoped_lock blockLock{*current};
+				current->_state = Block::State::partial;
+			}
+			_controlBlock->pushPartial(current);
+		}
+		_controlBlock->current.store(block, std::memory_order_release);
+		return run;
+	}
+
+	// Fills out with up to count cells from the shared blocks, returns at least one cell or throws
+	auto allocateShared(void** out, std::size_t count) -> std::size_t {
+		if constexpr (LOCK_FREE) {
+			return allocateLockFree(out, count);
+		} else {
 			std::scoped_lock lock{*_controlBlock};
-			block = _controlBlock->firstBlock;
+			std::size_t      taken{0};
+			if constexpr (REMOTE_FREE) {
+				if (const auto self = std::this_thread::get_id(); _controlBlock->owner.load(std::memory_order_relaxed) != self) {
+					_controlBlock->owner.store(self, std::memory_order_relaxed);
+				}
+				if (_controlBlock->remote.load(std::memory_order_relaxed) != nullptr) {
+					collectRemote();
+				}
+			}
+			for (;;) {
+				if (auto block = _controlBlock->current.load(std::memory_order_relaxed); block) {
+					taken += block->take(out + taken, count - taken);
+					if (taken == count) {
+						return taken;
+					}
+					_controlBlock->current.store(nullptr, std::memory_order_relaxed);
+				}
+
+				if (!nextCurrent(taken > 0)) {
+					return taken;
+				}
+			}
 		}
-		while (block) {
-			if (block->give(p)) {
+	}
+
+	auto allocateLockFree(void** out, std::size_t count) -> std::size_t {
+		std::size_t taken{0};
+		for (;;) {
+			auto block = _controlBlock->current.load(std::memory_order_acquire);
+			if (block) {
+				taken += block->take(out + taken, count - taken);
+				if (taken == count) {
+					return taken;
+				}
+			}
+
+			std::scoped_lock lock{*_controlBlock};
+			if (_controlBlock->current.load(std::memory_order_relaxed) != block) {
+				continue; // Another thread has already switched the block
+			}
+			if (block && !block->retire()) {
+				continue; // Some cells came back meanwhile
+			}
+			if (!nextCurrent(taken > 0)) {
+				return taken;
+			}
+		}
+	}
+
+	// Must be called under the ControlBlock lock, makes a partial or a new block current
+	// When Alloc fails, a caller that already has some cells gets false, otherwise the exception propagates
+	auto nextCurrent(bool haveCells) -> bool {
+		if (auto block = _controlBlock->firstPartial; block) {
+			_controlBlock->unlinkPartial(block);
+			if (block->_idle) {
+				block->_idle = false;
+				--_controlBlock->idleBlocks;
+			}
+			if constexpr (!LOCK_FREE) {
+				std::scoped_lock blockLock{*block};
+				block->_state = Block::State::current;
+			}
+			_controlBlock->current.store(block, std::memory_order_release);
+			return true;
+		}
+
+		try {
+			_controlBlock->current.store(createBlock(), std::memory_order_release);
+			return true;
+		} catch (...) {
+			_controlBlock->current.store(nullptr, std::memory_order_release);
+			if (!haveCells) {
+				throw;
+			}
+			return false;
+		}
+	}
+
+	// Must be called under the ControlBlock lock
+	auto createBlock() -> Block* {
+		auto&  alloc = _controlBlock->alloc;
+		Block* block = std::allocator_traits<alloc_type>::allocate(alloc, 1);
+		try {
+			std::allocator_traits<alloc_type>::construct(alloc, block, Alloc<std::byte>{alloc});
+		} catch (...) {
+			std::allocator_traits<alloc_type>::deallocate(alloc, block, 1);
+			throw;
+		}
+
+		if (!_controlBlock->blocks.insert(block)) {
+			std::allocator_traits<alloc_type>::destroy(alloc, block);
+			std::allocator_traits<alloc_type>::deallocate(alloc, block, 1);
+			throw std::bad_alloc();
+		}
+		block->_nextBlock = _controlBlock->firstBlock;
+		if (block->_nextBlock) {
+			block->_nextBlock->_prevBlock = block;
+		}
+		_controlBlock->firstBlock = block;
+		_controlBlock->stats.reserved(BLOCK_SIZE + PADDING, true);
+		return block;
+	}
+
+	// Must be called under the ControlBlock lock. Nobody else can change a block without live cells then, nor start using it.
+	// A lock-free block can still be taken from by a late thread, releaseBlock() checks it again.
+	static auto isIdle(Block* block) -> bool {
+		if constexpr (LOCK_FREE) {
+			return block->_live.load() == 0 && block->_carved.load() > 0;
+		} else {
+			std::scoped_lock lock{*block};
+			return block->_live == 0 && block->_carved > 0;
+		}
+	}
+
+	// Must be called under the ControlBlock lock, releases idle partial blocks until only keep of them remain (all for 0)
+	auto releaseIdle(std::size_t keep) -> std::size_t {
+		std::size_t released{0};
+		for (auto block = _controlBlock->firstPartial; block && (keep == 0 || _controlBlock->idleBlocks > keep);) {
+			auto next = block->_nextPartial;
+			if (isIdle(block)) {
+				if (block->_idle) {
+					block->_idle = false;
+					--_controlBlock->idleBlocks;
+				}
+				if (releaseBlock(block)) {
+					++released;
+				}
+			}
+			block = next;
+		}
+		return released;
+	}
+
+	// Must be called under the ControlBlock lock for a block without live cells
+	auto releaseBlock(Block* block) -> bool {
+		if constexpr (LOCK_FREE) {
+			if (!block->decommit()) {
+				return false;
+			}
+			_controlBlock->unlinkRuns(block);
+			return true;
+		}
+		if (_controlBlock->policy.decommit && block->decommit()) {
+			_controlBlock->unlinkRuns(block);
+			return true;
+		}
+		_controlBlock->unlinkRuns(block);
+
+		if (block == _controlBlock->current.load(std::memory_order_relaxed)) {
+			_controlBlock->current.store(nullptr, std::memory_order_relaxed);
+		} else {
+			_controlBlock->unlinkPartial(block);
+		}
+		if (block->_prevBlock) {
+			block->_prevBlock->_nextBlock = block->_nextBlock;
+		} else {
+			_controlBlock->firstBlock = block->_nextBlock;
+		}
+		if (block->_nextBlock) {
+			block->_nextBlock->_prevBlock = block->_prevBlock;
+		}
+		_controlBlock->blocks.erase(block);
+		std::allocator_traits<alloc_type>::destroy(_controlBlock->alloc, block);
+		std::allocator_traits<alloc_type>::deallocate(_controlBlock->alloc, block, 1);
+		_controlBlock->stats.released(BLOCK_SIZE + PADDING, true);
+		return true;
+	}
+
+	// Links the cells of every block into a chain and queues it with a single CAS. The queued cells are still live,
+	// so their block is not released before the owner collects them.
+	void pushRemote(void* const* cells, std::size_t count) noexcept {
+		for (std::size_t i{0}; i < count;) {
+			Block* block = _controlBlock->blocks.find(cells[i]);
+			auto   run   = i + 1;
+			for (; run < count && block != nullptr && _controlBlock->blocks.find(cells[run]) == block; ++run) {
+				*static_cast<void**>(cells[run - 1]) = cells[run];
+			}
+			if (block != nullptr && block->queue(cells[i], cells[run - 1])) {
+				// The stack is only ever emptied as a whole, so there is no ABA
+				auto head = _controlBlock->remote.load(std::memory_order_relaxed);
+				do {
+					block->_nextRemote = head;
+				} while (!_controlBlock->remote.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+			}
+			i = run;
+		}
+	}
+
+	// Must be called under the ControlBlock lock, gives the cells queued by other threads back to their blocks
+	void collectRemote() {
+		const auto maxIdleBlocks = _controlBlock->policy.maxIdleBlocks;
+		const bool keepLast      = maxIdleBlocks != std::numeric_limits<std::size_t>::max();
+		for (auto block = _controlBlock->remote.exchange(nullptr, std::memory_order_acquire); block != nullptr;) {
+			// Read before the queue is emptied, the next free into the block announces it again
+			auto next = block->_nextRemote;
+			{
+				std::scoped_lock blockLock{*block};
+				block->collect();
+				relist(block, keepLast);
+			}
+			block = next;
+		}
+		if (_controlBlock->idleBlocks > maxIdleBlocks) {
+			releaseIdle(maxIdleBlocks / 2);
+		}
+	}
+
+	void deallocateShared(void* const* cells, std::size_t count) noexcept {
+		if constexpr (REMOTE_FREE) {
+			if (_controlBlock->owner.load(std::memory_order_relaxed) != std::this_thread::get_id()) {
+				pushRemote(cells, count);
 				return;
 			}
+		}
+
+		const auto maxIdleBlocks = _controlBlock->policy.maxIdleBlocks;
+		const bool keepLast      = maxIdleBlocks != std::numeric_limits<std::size_t>::max();
+
+		// Cells freed together mostly come from the same block, so every run of them is returned under one lock
+		for (std::size_t i{0}; i < count;) {
+			Block* block = _controlBlock->blocks.find(cells[i]);
+			auto   run   = i + 1;
+			while (run < count && block != nullptr && _controlBlock->blocks.find(cells[run]) == block) {
+				++run;
+			}
+			if constexpr (LOCK_FREE) {
+				if (block != nullptr) {
+					deallocateLockFree(block, cells + i, run - i, keepLast);
+				}
+			} else if (block != nullptr && !block->give(cells + i, run - i, keepLast)) {
+				// The block changes its list, which needs the ControlBlock lock. Until the cells are pushed they are
+				// still live, so the block can not be released by anybody else in the meantime.
+				std::scoped_lock lock{*_controlBlock};
+				{
+					std::scoped_lock blockLock{*block};
+					block->push(cells + i, run - i);
+					relist(block, keepLast);
+				}
+				if (_controlBlock->idleBlocks > maxIdleBlocks) {
+					releaseIdle(maxIdleBlocks / 2);
+				}
+			}
+			i = run;
+		}
+	}
+
+	void deallocateLockFree(Block* block, void* const* cells, std::size_t count, bool keepLast) {
+		const auto given = block->giveLockFree(cells, count);
+		if (!given.wasFull && !(keepLast && given.nowIdle)) {
+			return;
+		}
+
+		// Blocks are never released in this mode, so the block may be touched even though its cells are free now
+		std::scoped_lock lock{*_controlBlock};
+		relistLockFree(block, given, keepLast);
+	}
+
+	void deallocateRun(void* run, std::size_t cls) noexcept {
+		Block* block = _controlBlock->blocks.find(run);
+		if (block == nullptr) {
+			return;
+		}
+
+		const auto       maxIdleBlocks = _controlBlock->policy.maxIdleBlocks;
+		const bool       keepLast      = maxIdleBlocks != std::numeric_limits<std::size_t>::max();
+		std::scoped_lock lock{*_controlBlock};
+		if (block->_runs[cls] == nullptr) {
+			_controlBlock->pushRun(block, cls);
+		}
+		if constexpr (LOCK_FREE) {
+			const auto nowIdle = block->pushRun(run, cls);
+			const auto wasFull = (block->_free.fetch_and(~Block::FULL) & Block::FULL) != 0;
+			relistLockFree(block, {wasFull, nowIdle}, keepLast);
+		} else {
 			{
-				std::scoped_lock lock{*block};
-				block = block->_nextBlock;
+				std::scoped_lock blockLock{*block};
+				block->pushRun(run, cls);
+				relist(block, keepLast);
+			}
+			if (_controlBlock->idleBlocks > maxIdleBlocks) {
+				releaseIdle(maxIdleBlocks / 2);
 			}
 		}
 	}
 
+	// Must be called under the ControlBlock and the Block lock once cells came back to the block
+	void relist(Block* block, bool keepLast) {
+		if (block->_state == Block::State::full) {
+			block->_state = Block::State::partial;
+			_controlBlock->pushPartial(block);
+		}
+		if (keepLast && block->_state == Block::State::partial && block->_live == 0 && block->_carved > 0 && !block->_idle) {
+			block->_idle = true;
+			++_controlBlock->idleBlocks;
+		}
+	}
+
+	// Must be called under the ControlBlock lock once cells came back to the block
+	void relistLockFree(Block* block, typename Block::Given given, bool keepLast) {
+		if (given.wasFull) {
+			_controlBlock->pushPartial(block);
+		}
+		if (keepLast && given.nowIdle && !block->_idle && block != _controlBlock->current.load(std::memory_order_relaxed)) {
+			block->_idle = true;
+			++_controlBlock->idleBlocks;
+			if (_controlBlock->idleBlocks > _controlBlock->policy.maxIdleBlocks) {
+				releaseIdle(_controlBlock->policy.maxIdleBlocks / 2);
+			}
+		}
+	}
+
+public:
+	template<typename U>
+	auto operator==(const block_adaptor<U, BLOCK_SIZE, Alloc, Mutex, MAGAZINE_SIZE, FreeList, Statistics>& other) const -> bool {
+		return _controlBlock->family == other._controlBlock->family;
+	}
+
+	template<typename U>
+	auto operator!=(const block_adaptor<U, BLOCK_SIZE, Alloc, Mutex, MAGAZINE_SIZE, FreeList, Statistics>& other) const -> bool {
+		return _controlBlock->family != other._controlBlock->family;
+	}
+
 private:
 	std::shared_ptr<ControlBlock> _controlBlock;
+	std::uint_least64_t           _id;
 };
 
-template<typename T, typename U>
-auto operator==(const block_adaptor<T>&, const block_adaptor<U>&) -> bool {
-	return false;
-}
-
-template<typename T, typename U>
-auto operator!=(const block_adaptor<T>&, const block_adaptor<U>&) -> bool {
-	return true;
-}
-
 } // namespace allocator
@@ -1,9 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdlib>
 #include <limits>
+#include <new>
 #include <stdexcept>
 
+#ifdef _WIN32
+#	include <malloc.h>
+#endif
+
 namespace allocator {
 
 template<class T>
@@ -21,7 +28,7 @@ struct mallocator {
 			throw std::bad_array_new_length{};
 		}
 
-		if (auto p = static_cast<T*>(std::malloc(n * sizeof(T)))) {
+		if (auto p = static_cast<T*>(allocateBytes(n * sizeof(T)))) {
 			return p;
 		}
 
@@ -29,8 +36,31 @@ struct mallocator {
 	}
 
 	void deallocate(T* p, [[maybe_unused]] std::size_t n) noexcept {
+#ifdef _WIN32
+		if constexpr (OVER_ALIGNED) {
+			_aligned_free(p);
+			return;
+		}
+#endif
 		std::free(p);
 	}
+
+private:
+	// malloc only guarantees alignment for the fundamental types
+	constexpr static const bool OVER_ALIGNED{alignof(T) > alignof(std::max_align_t)};
+
+	static auto allocateBytes(std::size_t bytes) -> void* {
+		if constexpr (OVER_ALIGNED) {
+#ifdef _WIN32
+			return _aligned_malloc(bytes, alignof(T));
+#else
+			// The size has to be a multiple of the alignment, sizeof(T) always is
+			return std::aligned_alloc(alignof(T), std::max(bytes, sizeof(T)));
+#endif
+		} else {
+			return std::malloc(bytes);
+		}
+	}
 };
 
 template<class T, class U>
@@ -1,35 +1,139 @@
 #pragma once
 
 #include "dummy_mutex.hpp"
+#include "statistics.hpp"
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <list>
+#include <map>
 #include <mio/mmap.hpp>
 #include <mutex>
+#include <optional>
+#include <set>
 #include <stdexcept>
+#include <string>
 #include <string_view>
+#include <stop_token>
 #include <system_error>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if __has_include(<unistd.h>)
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if __has_include(<sys/mman.h>)
+#include <sys/mman.h>
+#endif
 
 namespace allocator {
 
+/*
+	What the kernel is told about a mapping, all best effort. populate faults the pages in for writing right away
+	(MADV_POPULATE_WRITE, or writing a byte of every page back where that is missing, so not while others write there),
+	access and willNeed steer the readahead and hugePages asks for transparent huge pages, which shared mappings get on
+	tmpfs, so memfd, with huge pages enabled.
+*/
+enum class mmf_access { normal, sequential, random };
+
+struct mmf_hints {
+	mmf_access access{mmf_access::normal};
+	bool       willNeed{false};
+	bool       populate{false};
+	bool       hugePages{false};
+};
+
+/*
+	Released mappings of the file per allocation mode kept for reuse, up to maxBytes of them, so a workload that keeps
+	asking for the same sizes (block_adaptor always asks for BLOCK_SIZE) skips the open, mmap, munmap and unlink.
+	The files are sized to whole pages then and match by them, a reused mapping keeps whatever the previous allocation
+	left in it. Over the cap, the oldest or the largest cached mappings are dropped first.
+*/
+enum class mmf_eviction { oldest, largest };
+
+struct mmf_recycling {
+	std::size_t  maxBytes{0};
+	mmf_eviction eviction{mmf_eviction::oldest};
+};
+
+/*
+	A background thread that starts the writeback of the mappings every interval, at most bytesPerSecond of them (all of
+	them when 0), so the dirty pages leave steadily instead of in the stall the kernel imposes on the producers once
+	dirty_ratio is hit. It uses sync_file_range where there is one, msync(MS_ASYNC) elsewhere, and notes every tick how
+	many bytes of the mappings of the allocator are dirty, which is what /proc/self/smaps tells for them. It takes the
+	Mutex of the allocator only to look the mappings up, not for the writes, and it needs a real one.
+*/
+struct mmf_writeback {
+	std::chrono::milliseconds interval{0};
+	std::size_t               bytesPerSecond{0};
+};
+
+/*
+	By default every allocation is a file of its own. In the arena mode the allocations are carved out of sparse segment
+	files of segmentSize bytes, an allocation bigger than that gets a segment of its own size. Freed ranges go back to a
+	best-fit free list and are reused, their disk space is handed back by punching a hole where the platform can.
+	A segment that becomes completely free is removed, unless it is the last one.
+
+	Files are sized by ftruncate and mapped through the descriptor that created them. With reserve, posix_fallocate
+	backs them with disk blocks up front, so a full disk fails the allocation instead of a later page fault.
+	Without a directory the files are anonymous (O_TMPFILE), with memfd they live in memory (memfd_create) and
+	location() tells the descriptor to share with another process.
+
+	A persistent arena keeps everything in a single file named arena in the directory, segmentSize bytes big, and
+	leaves it behind. Its first pages hold a header and a table with the length of every live allocation, kept up to
+	date through the mapping, so a new allocator on the same directory finds the allocations of the previous one,
+	even after a crash. The memory lands at another address, so the data should link itself with offset_ptr and
+	be reached through root().
+*/
+struct mmf_options {
+	bool          arena{false};
+	std::size_t   segmentSize{std::size_t{1} << 30};
+	bool          reserve{false};
+	bool          memfd{false};
+	mmf_hints     hints{};
+	bool          persistent{false};
+	mmf_recycling recycling{};
+	mmf_writeback writeback{};
+};
+
+// Where an allocation of mmf_allocator lives, the descriptor of its file and the offset in it
+struct mmf_location {
+	mio::file_handle_type handle;
+	std::size_t           offset;
+};
+
 /**
  * @brief Memory-mapped file allocator
  * Each allocation is its own file. This is not usefull much on its own, but it can be used
  * in combination with block allocators to create a memory-mapped allocator.
  * It is quite heavy allocator, so you should do as big allocations as possible.
+ * With the statistics policy stats() counts the mapped files (segments in the arena mode) as blocks and their bytes as reserved.
  */
 
-template<class T, typename Mutex = dummy_mutex>
+template<class T, typename Mutex = dummy_mutex, typename Statistics = no_statistics>
 struct mmf_allocator {
-	template<typename, typename>
+	template<typename, typename, typename>
 	friend struct mmf_allocator;
 
 	using value_type = T;
 
-	explicit mmf_allocator(std::filesystem::path dir = "") : _p{std::make_shared<ControlBlock>(std::move(dir))} {
+	explicit mmf_allocator(std::filesystem::path dir = "", mmf_options options = {}) : _p{std::make_shared<ControlBlock>(std::move(dir), options)} {
+		if (_p->_options.persistent) {
+			openArena();
+		}
 	}
 
 	~mmf_allocator() = default;
@@ -40,7 +144,7 @@ struct mmf_allocator {
 	auto operator=(mmf_allocator&&) -> mmf_allocator&      = default;
 
 	template<typename U>
-	constexpr mmf_allocator(const mmf_allocator<U, Mutex>& other) noexcept : _p{*reinterpret_cast<const decltype(_p)*>(&other._p)} {
+	constexpr mmf_allocator(const mmf_allocator<U, Mutex, Statistics>& other) noexcept : _p{*reinterpret_cast<const decltype(_p)*>(&other._p)} {
 	}
 
 	[[nodiscard]] auto allocate(std::size_t n) -> value_type* {
@@ -48,64 +152,193 @@ struct mmf_allocator {
 			throw std::bad_array_new_length{};
 		}
 
-		std::filesystem::path filename;
-		// No need to lock here, because we do not change _p->_directory and it is safe to read it without lock
-		if (_p->_directory.empty()) {
-			filename = std::tmpnam(nullptr);
-		} else {
-			std::array<char, 20> buffer{0};
-			const auto           result = std::to_chars(buffer.begin(), buffer.end(), _p->_nextId++);
-			if (result.ec != std::errc{}) {
-				throw std::bad_alloc{};
-			}
-			filename = _p->_directory / std::string_view{buffer.data(), static_cast<std::size_t>(result.ptr - buffer.data())};
-		}
-		allocate_file(filename, n * sizeof(value_type));
-
-		std::error_code error;
-		mio::mmap_sink  mapping = mio::make_mmap_sink(filename.c_str(), 0, mio::map_entire_file, error);
+		const std::size_t bytes = n * sizeof(value_type);
+		auto              data  = _p->_options.arena ? allocateExtent(bytes) : allocateFile(bytes);
+		applyHints(reinterpret_cast<std::byte*>(data), bytes, _p->_options.hints);
+		_p->_stats.allocated(bytes);
+		return data;
+	}
 
-		if (error) {
-			throw std::runtime_error{error.message()};
+	void deallocate(value_type* p, std::size_t n) noexcept {
+		_p->_stats.deallocated(n * sizeof(value_type));
+		if (_p->_options.arena) {
+			deallocateExtent(p);
+			return;
 		}
 
-		auto data = reinterpret_cast<value_type*>(mapping.data());
+		std::list<MappingItem> released;
 		{
 			std::scoped_lock lock{_p->_mutex};
-			_p->_mappings.emplace(data, MappingItem{filename, std::move(mapping)});
+			auto             it = _p->_mappings.find(p);
+			if (it == _p->_mappings.end()) {
+				return;
+			}
+			if (!recycle(it->second)) {
+				released.push_back(std::move(it->second));
+			}
+			_p->_mappings.erase(it);
+			evict(released);
 		}
+		release(released);
+	}
 
-		return data;
+	// Writes every mapping back and waits until it is on the disk
+	void flush() {
+		const auto all = _p->ranges();
+		for (auto [data, size] : all) {
+#if defined(__linux__)
+			// The page cache is the mapping on Linux, so fsync of a copy of the descriptor does it without the lock
+			if (auto file = _p->duplicate(data, size); file && (file->handle == mio::invalid_handle || ::fsync(file->handle) != 0)) {
+				throw std::system_error{errno, std::system_category(), "Cannot flush the mapping"};
+			}
+#else
+			std::scoped_lock lock{_p->_mutex};
+			if (auto item = _p->find(data, size); item != nullptr) {
+				std::error_code error;
+				item->mapping.sync(error);
+				if (error) {
+					throw std::system_error{error};
+				}
+			}
+#endif
+		}
+		_p->_dirty.store(readDirty(all), std::memory_order_relaxed);
 	}
 
-	void deallocate(value_type* p, [[maybe_unused]] std::size_t n) noexcept {
-		std::filesystem::path filename;
+	// Dirty bytes of the mappings of this allocator as the writeback or flush() saw them last, 0 without /proc/self/smaps
+	[[nodiscard]] auto dirty_bytes() const noexcept -> std::size_t {
+		return _p->_dirty.load(std::memory_order_relaxed);
+	}
+
+	// Drops the cached mappings
+	void trim() noexcept {
+		std::list<MappingItem> released;
 		{
 			std::scoped_lock lock{_p->_mutex};
-			auto             it = _p->_mappings.find(p);
-			if (it == _p->_mappings.end()) {
-				return;
+			released.splice(released.end(), _p->_recycled);
+			_p->_recycledBySize.clear();
+			_p->_recycledBytes = 0;
+		}
+		release(released);
+	}
+
+	// Counters of the allocator, all zero with no_statistics
+	[[nodiscard]] auto stats() const -> allocator_stats {
+		auto snapshot           = _p->_stats.snapshot();
+		snapshot.contendedLocks = _p->_mutex.contended();
+		return snapshot;
+	}
+
+	// Whether p is the start of a mapping of this allocator
+	[[nodiscard]] auto owns(const value_type* p, [[maybe_unused]] std::size_t n) const -> bool {
+		std::scoped_lock lock{_p->_mutex};
+		if (_p->_options.arena) {
+			return _p->_extents.contains(reinterpret_cast<std::byte*>(const_cast<value_type*>(p)));
+		}
+		return _p->_mappings.contains(const_cast<value_type*>(p));
+	}
+
+	// Hints for a single allocation, on top of those the allocator gives all of them. False if the kernel refused any.
+	auto advise(value_type* p, std::size_t n, const mmf_hints& hints) noexcept -> bool {
+		return applyHints(reinterpret_cast<std::byte*>(p), n * sizeof(value_type), hints);
+	}
+
+	// The allocation a persistent arena hands out again after a restart, nullptr when there is none
+	[[nodiscard]] auto root() const -> value_type* {
+		std::scoped_lock lock{_p->_mutex};
+		if (_p->_header == nullptr || _p->_header->root == 0) {
+			return nullptr;
+		}
+		return reinterpret_cast<value_type*>(_p->_base + _p->_header->root);
+	}
+
+	void set_root(const value_type* p) {
+		std::scoped_lock lock{_p->_mutex};
+		if (_p->_header == nullptr) {
+			throw std::logic_error{"Only a persistent arena has a root"};
+		}
+		_p->_header->root = p == nullptr ? 0 : static_cast<std::uint64_t>(reinterpret_cast<const std::byte*>(p) - _p->_base);
+	}
+
+	// The file behind an allocation, for sharing the memfd backed memory with another process
+	[[nodiscard]] auto location(const value_type* p) const -> mmf_location {
+		auto* data = reinterpret_cast<std::byte*>(const_cast<value_type*>(p));
+
+		std::scoped_lock lock{_p->_mutex};
+		if (_p->_options.arena) {
+			auto it = _p->_extents.find(data);
+			if (it == _p->_extents.end()) {
+				throw std::invalid_argument{"Pointer was not allocated by this allocator"};
 			}
-			it->second.mapping.unmap();
-			filename = std::move(it->second.filename);
-			_p->_mappings.erase(p);
+			return {_p->_segments.at(it->second.segment).mapping.file_handle(), static_cast<std::size_t>(data - it->second.segment)};
 		}
-		std::filesystem::remove(filename);
+		auto it = _p->_mappings.find(const_cast<value_type*>(p));
+		if (it == _p->_mappings.end()) {
+			throw std::invalid_argument{"Pointer was not allocated by this allocator"};
+		}
+		return {it->second.mapping.file_handle(), 0};
 	}
 
-private:
-	static void allocate_file(const std::filesystem::path& filename, std::size_t size) {
-		std::ofstream ofs{filename, std::ios::binary | std::ios::out};
-		ofs.seekp(static_cast<std::streamoff>(size - 1));
-		ofs.put(0);
+	template<typename U>
+	auto operator==(const mmf_allocator<U, Mutex, Statistics>& other) const noexcept -> bool {
+		return _p.get() == reinterpret_cast<const void*>(other._p.get());
+	}
+
+	template<typename U>
+	auto operator!=(const mmf_allocator<U, Mutex, Statistics>& other) const noexcept -> bool {
+		return !(*this == other);
 	}
 
 private:
+	struct Extent {
+		std::size_t size;
+		std::byte*  segment;
+	};
+
+	// The first page of a persistent arena, the page table follows on the next page
+	struct ArenaHeader {
+		constexpr static const std::uint64_t MAGIC{0x636f6c6c'61666d6d}; // "mmfalloc"
+		constexpr static const std::uint32_t VERSION{1};
+
+		std::uint64_t magic;
+		std::uint32_t version;
+		std::uint32_t pageSize;
+		std::uint64_t size;
+		std::uint64_t root;
+	};
+
+	// Owns a descriptor, mio maps it without taking it over
+	struct FileHandle {
+		mio::file_handle_type handle{mio::invalid_handle};
+
+		FileHandle() = default;
+		explicit FileHandle(mio::file_handle_type handle) : handle{handle} {
+		}
+		FileHandle(const FileHandle&) = delete;
+		FileHandle(FileHandle&& other) noexcept : handle{std::exchange(other.handle, mio::invalid_handle)} {
+		}
+		auto operator=(const FileHandle&) -> FileHandle& = delete;
+		auto operator=(FileHandle&& other) noexcept -> FileHandle& {
+			std::swap(handle, other.handle);
+			return *this;
+		}
+		~FileHandle() {
+#if __has_include(<unistd.h>)
+			if (handle != mio::invalid_handle) {
+				::close(handle);
+			}
+#endif
+		}
+	};
+
+	// The mapping goes away before the descriptor it was made from
 	struct MappingItem {
 		std::filesystem::path filename;
+		FileHandle            file;
 		mio::mmap_sink        mapping;
 
-		MappingItem(std::filesystem::path filename, mio::mmap_sink&& mapping) : filename{std::move(filename)}, mapping{std::move(mapping)} {
+		MappingItem(std::filesystem::path filename, FileHandle&& file, mio::mmap_sink&& mapping)
+		    : filename{std::move(filename)}, file{std::move(file)}, mapping{std::move(mapping)} {
 		}
 		MappingItem(const MappingItem&)                        = delete;
 		MappingItem(MappingItem&&) noexcept                    = default;
@@ -114,16 +347,452 @@ private:
 		~MappingItem()                                         = default;
 	};
 
+	[[nodiscard]] auto nextFilename() -> std::filesystem::path {
+		// No need to lock here, because we do not change _p->_directory and it is safe to read it without lock
+		std::array<char, 20> buffer{0};
+		const auto           result = std::to_chars(buffer.begin(), buffer.end(), _p->_nextId++);
+		if (result.ec != std::errc{}) {
+			throw std::bad_alloc{};
+		}
+		return _p->_directory / std::string_view{buffer.data(), static_cast<std::size_t>(result.ptr - buffer.data())};
+	}
+
+	// A new file of size bytes mapped whole. Anonymous files have no name, so there is nothing to remove afterwards.
+	[[nodiscard]] auto mapFile(std::size_t size) -> MappingItem {
+		size = std::max(size, std::size_t{1});
+#if __has_include(<unistd.h>)
+		std::filesystem::path filename;
+		FileHandle            file;
+		if (_p->_options.memfd) {
+			file = createMemory();
+		} else if (_p->_directory.empty()) {
+			file = createAnonymous();
+		} else {
+			filename = nextFilename();
+			file     = FileHandle{::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)};
+		}
+		if (file.handle == mio::invalid_handle) {
+			throw std::system_error{errno, std::system_category(), "Cannot create the file to map"};
+		}
+
+		if (_p->_options.reserve) {
+			if (const int error = ::posix_fallocate(file.handle, 0, static_cast<off_t>(size)); error != 0) {
+				removeFile(filename);
+				throw std::system_error{error, std::system_category(), "Cannot reserve the file to map"};
+			}
+		} else if (::ftruncate(file.handle, static_cast<off_t>(size)) != 0) {
+			const int error = errno;
+			removeFile(filename);
+			throw std::system_error{error, std::system_category(), "Cannot size the file to map"};
+		}
+
+		std::error_code error;
+		mio::mmap_sink  mapping = mio::make_mmap_sink(file.handle, 0, size, error);
+#else
+		auto filename = _p->_directory.empty() ? std::filesystem::path{std::tmpnam(nullptr)} : nextFilename();
+		allocate_file(filename, size);
+
+		FileHandle      file;
+		std::error_code error;
+		mio::mmap_sink  mapping = mio::make_mmap_sink(filename.c_str(), 0, mio::map_entire_file, error);
+#endif
+
+		if (error) {
+			removeFile(filename);
+			throw std::runtime_error{error.message()};
+		}
+		return MappingItem{std::move(filename), std::move(file), std::move(mapping)};
+	}
+
+#if __has_include(<unistd.h>)
+	// O_TMPFILE where the filesystem has it, otherwise a unique name unlinked right away
+	[[nodiscard]] static auto createAnonymous() -> FileHandle {
+		const auto directory = std::filesystem::temp_directory_path();
+#ifdef O_TMPFILE
+		if (FileHandle file{::open(directory.c_str(), O_RDWR | O_TMPFILE | O_EXCL | O_CLOEXEC, 0600)}; file.handle != mio::invalid_handle) {
+			return file;
+		}
+#endif
+		auto       pattern = (directory / "mmf_allocator.XXXXXX").string();
+		FileHandle file{::mkstemp(pattern.data())};
+		if (file.handle != mio::invalid_handle) {
+			::unlink(pattern.c_str());
+		}
+		return file;
+	}
+
+	[[nodiscard]] static auto createMemory() -> FileHandle {
+#ifdef MFD_CLOEXEC
+		return FileHandle{::memfd_create("mmf_allocator", MFD_CLOEXEC)};
+#else
+		return createAnonymous();
+#endif
+	}
+#endif
+
+	static void removeFile(const std::filesystem::path& filename) noexcept {
+		if (!filename.empty()) {
+			std::error_code error;
+			std::filesystem::remove(filename, error);
+		}
+	}
+
+	[[nodiscard]] auto allocateFile(std::size_t bytes) -> value_type* {
+		if (_p->_options.recycling.maxBytes != 0) {
+			std::scoped_lock lock{_p->_mutex};
+			auto [first, last] = _p->_recycledBySize.equal_range(pageCeil(bytes));
+			if (first != last) {
+				// The most recently released one, its pages are the likeliest to be still resident
+				auto recycled = std::prev(last);
+				auto item     = recycled->second;
+				auto data     = reinterpret_cast<value_type*>(item->mapping.data());
+				_p->_mappings.emplace(data, std::move(*item));
+				_p->_recycledBytes -= recycled->first;
+				_p->_recycledBySize.erase(recycled);
+				_p->_recycled.erase(item);
+				return data;
+			}
+		}
+
+		// With recycling every file spans whole pages, so a reused one is as long as the allocation it serves next
+		auto item = mapFile(_p->_options.recycling.maxBytes != 0 ? pageCeil(bytes) : bytes);
+		auto data = reinterpret_cast<value_type*>(item.mapping.data());
+		_p->_stats.reserved(item.mapping.size(), true);
+		{
+			std::scoped_lock lock{_p->_mutex};
+			_p->_mappings.emplace(data, std::move(item));
+		}
+		return data;
+	}
+
+	[[nodiscard]] static auto pageCeil(std::size_t bytes) -> std::size_t {
+		const std::size_t page = mio::page_size();
+		return std::max((bytes + page - 1) / page * page, page);
+	}
+
+	// Keeps a released mapping in the cache if it fits under the cap at all, the caller holds the lock
+	auto recycle(MappingItem& item) noexcept -> bool {
+		const std::size_t size = item.mapping.size();
+		if (size > _p->_options.recycling.maxBytes) {
+			return false;
+		}
+		try {
+			_p->_recycled.push_front(std::move(item));
+			try {
+				_p->_recycledBySize.emplace(size, _p->_recycled.begin());
+			} catch (...) {
+				item = std::move(_p->_recycled.front());
+				_p->_recycled.pop_front();
+				return false;
+			}
+		} catch (...) {
+			return false;
+		}
+		_p->_recycledBytes += size;
+		return true;
+	}
+
+	// Moves the cached mappings over the cap to released, the caller holds the lock
+	void evict(std::list<MappingItem>& released) noexcept {
+		while (_p->_recycledBytes > _p->_options.recycling.maxBytes) {
+			auto victim = _p->_recycledBySize.end();
+			if (_p->_options.recycling.eviction == mmf_eviction::largest) {
+				victim = std::prev(_p->_recycledBySize.end());
+			} else {
+				const auto oldest  = std::prev(_p->_recycled.end());
+				auto [first, last] = _p->_recycledBySize.equal_range(oldest->mapping.size());
+				victim             = std::find_if(first, last, [&](const auto& entry) { return entry.second == oldest; });
+			}
+			_p->_recycledBytes -= victim->first;
+			released.splice(released.end(), _p->_recycled, victim->second);
+			_p->_recycledBySize.erase(victim);
+		}
+	}
+
+	// Drops the mappings released by the allocator, not by the ControlBlock going away
+	void release(std::list<MappingItem>& released) noexcept {
+		for (auto& item : released) {
+			_p->_stats.released(item.mapping.size(), true);
+		}
+		drop(released);
+	}
+
+	// Unmaps before removing, a mapped file cannot be removed everywhere
+	static void drop(std::list<MappingItem>& released) noexcept {
+		for (auto& item : released) {
+			item.mapping.unmap();
+			removeFile(item.filename);
+		}
+	}
+
+	// Best fit from the free extents, a new segment when none is big enough
+	[[nodiscard]] auto allocateExtent(std::size_t bytes) -> value_type* {
+		const std::size_t page = mio::page_size();
+		bytes                  = pageCeil(bytes);
+
+		std::scoped_lock lock{_p->_mutex};
+		auto             it = _p->_freeBySize.lower_bound({bytes, nullptr});
+		if (it == _p->_freeBySize.end()) {
+			if (_p->_header != nullptr) {
+				throw std::bad_alloc{};
+			}
+			addSegment(std::max(_p->_options.segmentSize, bytes));
+			it = _p->_freeBySize.lower_bound({bytes, nullptr});
+		}
+
+		auto* data   = it->second;
+		auto  free   = _p->_free.find(data);
+		auto  extent = free->second;
+		_p->_freeBySize.erase(it);
+		_p->_free.erase(free);
+
+		if (extent.size > bytes) {
+			insertFree(data + bytes, {extent.size - bytes, extent.segment});
+		}
+		_p->_extents.emplace(data, Extent{bytes, extent.segment});
+		if (_p->_header != nullptr) {
+			_p->_table[(data - _p->_base) / page] = static_cast<std::uint32_t>(bytes / page);
+		}
+		return reinterpret_cast<value_type*>(data);
+	}
+
+	void deallocateExtent(value_type* p) noexcept {
+		auto* data = reinterpret_cast<std::byte*>(p);
+
+		std::scoped_lock lock{_p->_mutex};
+		auto             it = _p->_extents.find(data);
+		if (it == _p->_extents.end()) {
+			return;
+		}
+		auto extent = it->second;
+		_p->_extents.erase(it);
+		if (_p->_header != nullptr) {
+			_p->_table[static_cast<std::size_t>(data - _p->_base) / mio::page_size()] = 0;
+		}
+
+		auto& segment = _p->_segments.at(extent.segment);
+		punchHole(segment, static_cast<std::size_t>(data - extent.segment), extent.size);
+
+		// Coalesce with the neighbours, but never across two segments that happen to be mapped next to each other
+		auto next = _p->_free.find(data + extent.size);
+		if (next != _p->_free.end() && next->second.segment == extent.segment) {
+			extent.size += next->second.size;
+			eraseFree(next);
+		}
+		auto prev = _p->_free.lower_bound(data);
+		if (prev != _p->_free.begin() && (--prev)->second.segment == extent.segment && prev->first + prev->second.size == data) {
+			data = prev->first;
+			extent.size += prev->second.size;
+			eraseFree(prev);
+		}
+
+		if (extent.size == segment.mapping.size() && _p->_segments.size() > 1) {
+			_p->_stats.released(segment.mapping.size(), true);
+			auto filename = std::move(segment.filename);
+			_p->_segments.erase(extent.segment);
+			removeFile(filename);
+			return;
+		}
+		insertFree(data, extent);
+	}
+
+	/*
+		Maps the arena of a persistent allocator, formatting it on the first run. On the next runs the live allocations are
+		read back from the page table and the gaps between them become the free extents.
+	*/
+	void openArena() {
+		if (!_p->_options.arena || _p->_directory.empty() || _p->_options.memfd) {
+			throw std::invalid_argument{"A persistent allocator has to be an arena in a directory"};
+		}
+
+		const std::size_t page     = mio::page_size();
+		const auto        filename = _p->_directory / "arena";
+		if (!std::filesystem::exists(filename) || std::filesystem::file_size(filename) == 0) {
+			formatArena(filename);
+		}
+
+		std::error_code error;
+		mio::mmap_sink  mapping = mio::make_mmap_sink(filename.c_str(), 0, mio::map_entire_file, error);
+		if (error) {
+			throw std::runtime_error{error.message()};
+		}
+
+		auto* data   = reinterpret_cast<std::byte*>(mapping.data());
+		auto* header = reinterpret_cast<ArenaHeader*>(data);
+		if (header->magic != ArenaHeader::MAGIC || header->version != ArenaHeader::VERSION || header->pageSize != page || header->size != mapping.size()) {
+			throw std::runtime_error{"Not a persistent arena: " + filename.string()};
+		}
+
+		const std::size_t pages = header->size / page;
+		auto*             table = reinterpret_cast<std::uint32_t*>(data + page);
+		const std::size_t first = 1 + (pages * sizeof(std::uint32_t) + page - 1) / page;
+		if (first >= pages) {
+			throw std::invalid_argument{"The persistent arena is too small for its page table"};
+		}
+
+		std::scoped_lock lock{_p->_mutex};
+		_p->_header = header;
+		_p->_table  = table;
+		_p->_base   = data;
+		for (std::size_t index = first, gap = first; index <= pages; ++index) {
+			if (index < pages && table[index] == 0) {
+				continue;
+			}
+			if (index > gap) {
+				insertFree(data + gap * page, {(index - gap) * page, data});
+			}
+			if (index < pages) {
+				if (table[index] > pages - index) {
+					throw std::runtime_error{"Corrupted page table of the persistent arena: " + filename.string()};
+				}
+				_p->_extents.emplace(data + index * page, Extent{table[index] * page, data});
+				index += table[index] - 1;
+				gap = index + 1;
+			}
+		}
+		_p->_stats.reserved(mapping.size(), true);
+		_p->_segments.emplace(data, MappingItem{filename, FileHandle{}, std::move(mapping)});
+	}
+
+	// The arena is made under another name and renamed into place, so a crash never leaves one without its header behind
+	void formatArena(const std::filesystem::path& filename) const {
+		const std::size_t page       = mio::page_size();
+		const auto        formatting = std::filesystem::path{filename} += ".new";
+		std::ofstream{formatting, std::ios::binary | std::ios::out | std::ios::trunc};
+		std::filesystem::resize_file(formatting, std::max(_p->_options.segmentSize / page, std::size_t{2}) * page);
+
+		std::error_code error;
+		mio::mmap_sink  mapping = mio::make_mmap_sink(formatting.c_str(), 0, mio::map_entire_file, error);
+		if (!error) {
+			*reinterpret_cast<ArenaHeader*>(mapping.data()) = {ArenaHeader::MAGIC, ArenaHeader::VERSION, static_cast<std::uint32_t>(page), mapping.size(), 0};
+			mapping.sync(error);
+		}
+		if (error) {
+			removeFile(formatting);
+			throw std::runtime_error{error.message()};
+		}
+		mapping.unmap();
+		std::filesystem::rename(formatting, filename);
+	}
+
+	void addSegment(std::size_t size) {
+		auto  item = mapFile(size);
+		auto* data = reinterpret_cast<std::byte*>(item.mapping.data());
+		_p->_stats.reserved(item.mapping.size(), true);
+		_p->_segments.emplace(data, std::move(item));
+		insertFree(data, {size, data});
+	}
+
+	void insertFree(std::byte* data, Extent extent) {
+		_p->_free.emplace(data, extent);
+		_p->_freeBySize.emplace(extent.size, data);
+	}
+
+	void eraseFree(typename std::map<std::byte*, Extent>::iterator it) {
+		_p->_freeBySize.erase({it->second.size, it->first});
+		_p->_free.erase(it);
+	}
+
+	static auto applyHints([[maybe_unused]] std::byte* data, [[maybe_unused]] std::size_t size, const mmf_hints& hints) noexcept -> bool {
+		bool taken{true};
+#if __has_include(<sys/mman.h>)
+		if (size == 0) {
+			return taken;
+		}
+		switch (hints.access) {
+		case mmf_access::sequential:
+			taken &= ::madvise(data, size, MADV_SEQUENTIAL) == 0;
+			break;
+		case mmf_access::random:
+			taken &= ::madvise(data, size, MADV_RANDOM) == 0;
+			break;
+		case mmf_access::normal:
+			break;
+		}
+		if (hints.willNeed) {
+			taken &= ::madvise(data, size, MADV_WILLNEED) == 0;
+		}
+		if (hints.hugePages) {
+#ifdef MADV_HUGEPAGE
+			taken &= ::madvise(data, size, MADV_HUGEPAGE) == 0;
+#else
+			taken = false;
+#endif
+		}
+		if (hints.populate) {
+#ifdef MADV_POPULATE_WRITE
+			if (::madvise(data, size, MADV_POPULATE_WRITE) == 0) {
+				return taken;
+			}
+#endif
+			// A read fault maps a shared page read-only, so every page is written with what it holds to fault it in writable
+			const std::size_t page = mio::page_size();
+			for (std::size_t offset = 0; offset < size; offset += page) {
+				auto* byte = static_cast<volatile std::byte*>(data + offset);
+				*byte      = *byte;
+			}
+		}
+#else
+		taken = hints.access == mmf_access::normal && !hints.willNeed && !hints.hugePages && !hints.populate;
+#endif
+		return taken;
+	}
+
+	// Gives the disk space of a freed range back, the range reads as zeros afterwards
+	static void punchHole([[maybe_unused]] MappingItem& segment, [[maybe_unused]] std::size_t offset, [[maybe_unused]] std::size_t size) noexcept {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+		::fallocate(segment.mapping.file_handle(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size));
+#endif
+	}
+
+#if !__has_include(<unistd.h>)
+	static void allocate_file(const std::filesystem::path& filename, std::size_t size) {
+		std::ofstream ofs{filename, std::ios::binary | std::ios::out};
+		ofs.seekp(static_cast<std::streamoff>(size - 1));
+		ofs.put(0);
+	}
+#endif
+
+private:
 	struct ControlBlock {
 		std::atomic_uint_least32_t                   _nextId{0};
 		std::filesystem::path                        _directory;
+		const mmf_options                            _options;
 		std::unordered_map<value_type*, MappingItem> _mappings;
-		Mutex                                        _mutex;
+		detail::counted_mutex<Mutex, Statistics>     _mutex;
+
+		[[no_unique_address]] detail::counters<Statistics> _stats;
+
+		// Released mappings for reuse, the newest first, and by their size
+		std::list<MappingItem>                                                _recycled;
+		std::multimap<std::size_t, typename std::list<MappingItem>::iterator> _recycledBySize;
+		std::size_t                                                           _recycledBytes{0};
+
+		// The arena mode, segments by their start, free extents by address for coalescing and by size for the best fit
+		std::unordered_map<std::byte*, MappingItem>  _segments;
+		std::map<std::byte*, Extent>                 _free;
+		std::set<std::pair<std::size_t, std::byte*>> _freeBySize;
+		std::unordered_map<std::byte*, Extent>       _extents;
 
-		explicit ControlBlock(std::filesystem::path dir) : _directory{std::move(dir)} {
+		// The persistent arena, its header and page table live in its first pages
+		ArenaHeader*   _header{nullptr};
+		std::uint32_t* _table{nullptr};
+		std::byte*     _base{nullptr};
+
+		// The writeback, the thread goes first, before anything it touches
+		std::atomic_size_t _dirty{0};
+		std::jthread       _writeback;
+
+		explicit ControlBlock(std::filesystem::path dir, mmf_options options) : _directory{std::move(dir)}, _options{options} {
 			if (!_directory.empty() && !std::filesystem::exists(_directory)) {
 				std::filesystem::create_directories(_directory);
 			}
+			if (_options.writeback.interval.count() > 0) {
+				if constexpr (std::is_same_v<Mutex, dummy_mutex>) {
+					throw std::invalid_argument{"The writeback needs a real Mutex"};
+				}
+				_writeback = std::jthread{[this](std::stop_token stop) { writeback(stop); }};
+			}
 		}
 
 		ControlBlock(const ControlBlock&)                    = delete;
@@ -132,16 +801,161 @@ private:
 		auto operator=(ControlBlock&&) -> ControlBlock&      = delete;
 
 		~ControlBlock() {
+			if (_writeback.joinable()) {
+				_writeback.request_stop();
+				_writeback.join();
+			}
 			for (auto& [_, item] : _mappings) {
 				item.mapping.unmap();
-				std::filesystem::remove(item.filename);
+				removeFile(item.filename);
+			}
+			drop(_recycled);
+			if (_header != nullptr) {
+				for (auto& [_, segment] : _segments) {
+					std::error_code error;
+					segment.mapping.sync(error);
+				}
+				return;
+			}
+			for (auto& [_, segment] : _segments) {
+				segment.mapping.unmap();
+				removeFile(segment.filename);
 			}
 			if (!_directory.empty()) {
 				std::filesystem::remove_all(_directory);
 			}
 		}
+
+		// The mappings and segments by address, to walk them without holding the lock
+		[[nodiscard]] auto ranges() -> std::vector<std::pair<std::byte*, std::size_t>> {
+			std::vector<std::pair<std::byte*, std::size_t>> result;
+			{
+				std::scoped_lock lock{_mutex};
+				result.reserve(_mappings.size() + _segments.size());
+				for (auto& [data, item] : _mappings) {
+					result.emplace_back(reinterpret_cast<std::byte*>(data), item.mapping.size());
+				}
+				for (auto& [data, item] : _segments) {
+					result.emplace_back(data, item.mapping.size());
+				}
+			}
+			std::ranges::sort(result);
+			return result;
+		}
+
+		// The mapping still at data, nullptr when it is gone in the meantime, the caller holds the lock
+		[[nodiscard]] auto find(std::byte* data, std::size_t size) -> MappingItem* {
+			MappingItem* item = nullptr;
+			if (auto it = _mappings.find(reinterpret_cast<value_type*>(data)); it != _mappings.end()) {
+				item = &it->second;
+			} else if (auto segment = _segments.find(data); segment != _segments.end()) {
+				item = &segment->second;
+			}
+			return item != nullptr && item->mapping.size() == size ? item : nullptr;
+		}
+
+#if __has_include(<unistd.h>)
+		// A copy of the descriptor of the mapping still at data, which outlives the mapping, nullopt when it is gone
+		[[nodiscard]] auto duplicate(std::byte* data, std::size_t size) -> std::optional<FileHandle> {
+			std::scoped_lock lock{_mutex};
+			if (auto item = find(data, size); item != nullptr) {
+				return FileHandle{::dup(item->mapping.file_handle())};
+			}
+			return std::nullopt;
+		}
+#endif
+
+		// Each tick starts the writeback of the next budget of bytes, going round the mappings by address
+		void writeback(const std::stop_token& stop) {
+			std::mutex                  sleep;
+			std::condition_variable_any wake;
+			std::byte*                  cursor = nullptr;
+
+			const auto        interval = _options.writeback.interval;
+			const std::size_t budget   = _options.writeback.bytesPerSecond == 0
+			                                 ? std::numeric_limits<std::size_t>::max()
+			                                 : static_cast<std::size_t>(_options.writeback.bytesPerSecond * std::chrono::duration<double>{interval}.count());
+
+			while (true) {
+				{
+					std::unique_lock lock{sleep};
+					wake.wait_for(lock, stop, interval, [] { return false; });
+				}
+				if (stop.stop_requested()) {
+					return;
+				}
+
+				auto        all  = ranges();
+				std::size_t left = std::max(budget, std::size_t{1});
+				for (std::size_t visited = 0; visited <= all.size() && left > 0 && !all.empty(); ++visited) {
+					// The range holding the cursor or the next one, round to the first after the last
+					auto it = std::ranges::upper_bound(all, cursor, {}, &std::pair<std::byte*, std::size_t>::first);
+					if (it != all.begin() && cursor < std::prev(it)->first + std::prev(it)->second) {
+						--it;
+					}
+					if (it == all.end()) {
+						it     = all.begin();
+						cursor = it->first;
+					}
+
+					auto*             from = std::max(cursor, it->first);
+					const std::size_t size = std::min(static_cast<std::size_t>(it->first + it->second - from), left);
+					startWriteback(it->first, it->second, static_cast<std::size_t>(from - it->first), size);
+					left -= size;
+					cursor = from + size;
+				}
+				_dirty.store(readDirty(all), std::memory_order_relaxed);
+			}
+		}
+
+		/*
+			Starts the writeback of size bytes from offset of the mapping at data. sync_file_range blocks once the queue
+			of the device is full, so it goes through a copy of the descriptor with the lock released. msync(MS_ASYNC)
+			only marks the pages, but needs the mapping, so it stays under the lock.
+		*/
+		void startWriteback(std::byte* data, std::size_t mapped, std::size_t offset, std::size_t size) {
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+			if (auto file = duplicate(data, mapped); file && file->handle != mio::invalid_handle) {
+				::sync_file_range(file->handle, static_cast<off_t>(offset), static_cast<off_t>(size), SYNC_FILE_RANGE_WRITE);
+			}
+#elif __has_include(<sys/mman.h>)
+			std::scoped_lock lock{_mutex};
+			if (auto item = find(data, mapped); item != nullptr) {
+				const std::size_t page  = mio::page_size();
+				const std::size_t begin = offset / page * page;
+				::msync(item->mapping.data() + begin, offset + size - begin, MS_ASYNC);
+			}
+#endif
+		}
 	};
 
+	/*
+		Dirty bytes of the given ranges, the Shared_Dirty and Private_Dirty of every mapping in /proc/self/smaps that
+		starts in one of them. The kernel cleans the pages as their writeback starts, so it is what is still to be written.
+	*/
+	[[nodiscard]] static auto readDirty(const std::vector<std::pair<std::byte*, std::size_t>>& ranges) -> std::size_t {
+		std::ifstream smaps{"/proc/self/smaps"};
+		std::string   line;
+		std::size_t   dirty{0};
+		bool          inside{false};
+		while (std::getline(smaps, line)) {
+			// A mapping starts with its address range in lowercase hexadecimal, its counters with a capital letter
+			if (!line.empty() && ((line[0] >= '0' && line[0] <= '9') || (line[0] >= 'a' && line[0] <= 'f'))) {
+				std::uintptr_t start{0};
+				std::from_chars(line.data(), line.data() + line.size(), start, 16);
+				auto* address = reinterpret_cast<std::byte*>(start);
+				auto  it      = std::ranges::upper_bound(ranges, address, {}, &std::pair<std::byte*, std::size_t>::first);
+				inside        = it != ranges.begin() && address < std::prev(it)->first + std::prev(it)->second;
+			} else if (inside && (line.starts_with("Shared_Dirty:") || line.starts_with("Private_Dirty:"))) {
+				const auto  digits = std::min(line.find_first_of("0123456789"), line.size());
+				std::size_t kilobytes{0};
+				std::from_chars(line.data() + digits, line.data() + line.size(), kilobytes);
+				dirty += kilobytes * 1024;
+			}
+		}
+		return dirty;
+	}
+
 	std::shared_ptr<ControlBlock> _p;
 };
 
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <compare>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+
+namespace allocator {
+
+/*
+	A pointer that keeps the distance from itself to its target instead of an address, so structures linked by them stay
+	valid when the memory holding them is mapped at another address, like a persistent mmf_allocator arena after a restart.
+	The pointer and its target have to live in the same mapping. Copies recompute the distance from their own address.
+	The distance 1 stands for nullptr, no object can start inside the pointer itself.
+*/
+template<typename T>
+class offset_ptr {
+public:
+	using element_type      = T;
+	using value_type        = std::remove_cv_t<T>;
+	using difference_type   = std::ptrdiff_t;
+	using pointer           = T*;
+	using reference         = std::add_lvalue_reference_t<T>;
+	using iterator_category = std::random_access_iterator_tag;
+	using iterator_concept  = std::contiguous_iterator_tag;
+
+	template<typename U>
+	using rebind = offset_ptr<U>;
+
+	offset_ptr() noexcept = default;
+
+	offset_ptr(std::nullptr_t) noexcept {
+	}
+
+	offset_ptr(T* p) noexcept {
+		set(p);
+	}
+
+	offset_ptr(const offset_ptr& other) noexcept {
+		set(other.get());
+	}
+
+	template<typename U>
+		requires std::convertible_to<U*, T*>
+	offset_ptr(const offset_ptr<U>& other) noexcept {
+		set(other.get());
+	}
+
+	template<typename U>
+		requires(!std::convertible_to<U*, T*> && requires(U* p) { static_cast<T*>(p); })
+	explicit offset_ptr(const offset_ptr<U>& other) noexcept {
+		set(static_cast<T*>(other.get()));
+	}
+
+	~offset_ptr() = default;
+
+	auto operator=(const offset_ptr& other) noexcept -> offset_ptr& {
+		set(other.get());
+		return *this;
+	}
+
+	auto operator=(T* p) noexcept -> offset_ptr& {
+		set(p);
+		return *this;
+	}
+
+	auto operator=(std::nullptr_t) noexcept -> offset_ptr& {
+		_offset = NULL_OFFSET;
+		return *this;
+	}
+
+	template<typename U = T>
+		requires(!std::is_void_v<U>)
+	static auto pointer_to(std::add_lvalue_reference_t<U> r) noexcept -> offset_ptr {
+		return offset_ptr{&r};
+	}
+
+	[[nodiscard]] auto get() const noexcept -> T* {
+		if (_offset == NULL_OFFSET) {
+			return nullptr;
+		}
+		return reinterpret_cast<T*>(reinterpret_cast<std::uintptr_t>(this) + static_cast<std::uintptr_t>(_offset));
+	}
+
+	auto operator*() const noexcept -> reference
+		requires(!std::is_void_v<T>)
+	{
+		return *get();
+	}
+
+	auto operator->() const noexcept -> T* {
+		return get();
+	}
+
+	auto operator[](difference_type i) const noexcept -> reference
+		requires(!std::is_void_v<T>)
+	{
+		return get()[i];
+	}
+
+	explicit operator bool() const noexcept {
+		return _offset != NULL_OFFSET;
+	}
+
+	auto operator++() noexcept -> offset_ptr& {
+		_offset += sizeof(T);
+		return *this;
+	}
+
+	auto operator++(int) noexcept -> offset_ptr {
+		offset_ptr previous{*this};
+		++*this;
+		return previous;
+	}
+
+	auto operator--() noexcept -> offset_ptr& {
+		_offset -= sizeof(T);
+		return *this;
+	}
+
+	auto operator--(int) noexcept -> offset_ptr {
+		offset_ptr previous{*this};
+		--*this;
+		return previous;
+	}
+
+	auto operator+=(difference_type n) noexcept -> offset_ptr& {
+		_offset += n * static_cast<difference_type>(sizeof(T));
+		return *this;
+	}
+
+	auto operator-=(difference_type n) noexcept -> offset_ptr& {
+		_offset -= n * static_cast<difference_type>(sizeof(T));
+		return *this;
+	}
+
+	friend auto operator+(offset_ptr p, difference_type n) noexcept -> offset_ptr {
+		return offset_ptr{p.get() + n};
+	}
+
+	friend auto operator+(difference_type n, offset_ptr p) noexcept -> offset_ptr {
+		return offset_ptr{p.get() + n};
+	}
+
+	friend auto operator-(offset_ptr p, difference_type n) noexcept -> offset_ptr {
+		return offset_ptr{p.get() - n};
+	}
+
+	friend auto operator-(const offset_ptr& a, const offset_ptr& b) noexcept -> difference_type {
+		return a.get() - b.get();
+	}
+
+	friend auto operator==(const offset_ptr& a, const offset_ptr& b) noexcept -> bool {
+		return a.get() == b.get();
+	}
+
+	friend auto operator==(const offset_ptr& a, std::nullptr_t) noexcept -> bool {
+		return !a;
+	}
+
+	friend auto operator<=>(const offset_ptr& a, const offset_ptr& b) noexcept -> std::strong_ordering {
+		return std::compare_three_way{}(a.get(), b.get());
+	}
+
+private:
+	constexpr static const difference_type NULL_OFFSET{1};
+
+	void set(T* p) noexcept {
+		_offset = p == nullptr ? NULL_OFFSET : static_cast<difference_type>(reinterpret_cast<std::uintptr_t>(p) - reinterpret_cast<std::uintptr_t>(this));
+	}
+
+	difference_type _offset{NULL_OFFSET};
+};
+
+} // namespace allocator
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace allocator {
+
+namespace detail {
+/*
+	Memory aligned beyond what the allocator underneath guarantees. allocate(size) and deallocate(base, size) get the
+	over-allocated block, the offset of the returned pointer from its start is kept right in front of it. The offset
+	needs that room, so the shift is never zero.
+*/
+constexpr auto overAlignedSize(std::size_t bytes, std::size_t alignment) -> std::size_t {
+	return bytes + alignment + sizeof(std::size_t);
+}
+
+template<typename Allocate>
+auto allocateOverAligned(std::size_t bytes, std::size_t alignment, Allocate&& allocate) -> void* {
+	auto base    = static_cast<std::byte*>(allocate(overAlignedSize(bytes, alignment)));
+	auto address = reinterpret_cast<std::uintptr_t>(base + sizeof(std::size_t));
+	auto offset  = static_cast<std::size_t>((address + alignment - 1) / alignment * alignment - address) + sizeof(std::size_t);
+	std::memcpy(base + offset - sizeof(std::size_t), &offset, sizeof(offset));
+	return base + offset;
+}
+
+template<typename Deallocate>
+void deallocateOverAligned(void* p, std::size_t bytes, std::size_t alignment, Deallocate&& deallocate) {
+	std::size_t offset{0};
+	std::memcpy(&offset, static_cast<std::byte*>(p) - sizeof(std::size_t), sizeof(offset));
+	deallocate(static_cast<std::byte*>(p) - offset, overAlignedSize(bytes, alignment));
+}
+} // namespace detail
+
+} // namespace allocator
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <utility>
+
+#include "over_aligned.hpp"
+
+namespace allocator {
+
+/*
+	std::pmr::memory_resource on top of any allocator of this library, so the pools can back std::pmr containers.
+	Allocators with allocate_bytes (universal_block_adaptor) get the bytes and the alignment as they are and honour both.
+	The others get ceil(bytes / sizeof(value_type)) elements, which they dispatch at run time as well.
+	Alignments above alignof(value_type) are met by over-allocating and keeping the offset right in front of the memory.
+	Two resources compare equal when their allocators do, so moving a pmr container between them does not copy.
+*/
+template<typename Alloc>
+class resource_adaptor : public std::pmr::memory_resource {
+public:
+	using allocator_type = Alloc;
+	using value_type     = typename std::allocator_traits<Alloc>::value_type;
+
+	explicit resource_adaptor(Alloc alloc = Alloc{}) : _alloc{std::move(alloc)} {
+	}
+
+	[[nodiscard]] auto get_allocator() const -> const allocator_type& {
+		return _alloc;
+	}
+
+private:
+	constexpr static const bool        UNTYPED{requires(Alloc& alloc) { alloc.allocate_bytes(std::size_t{}, std::size_t{}); }};
+	constexpr static const std::size_t ALIGNMENT{UNTYPED ? std::numeric_limits<std::size_t>::max() : alignof(value_type)};
+
+	auto do_allocate(std::size_t bytes, std::size_t alignment) -> void* override {
+		if (alignment <= ALIGNMENT) {
+			return allocateRaw(bytes, alignment);
+		}
+
+		return detail::allocateOverAligned(bytes, alignment, [this](std::size_t size) { return allocateRaw(size, ALIGNMENT); });
+	}
+
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+		if (alignment <= ALIGNMENT) {
+			deallocateRaw(p, bytes, alignment);
+			return;
+		}
+
+		detail::deallocateOverAligned(p, bytes, alignment, [this](void* base, std::size_t size) { deallocateRaw(base, size, ALIGNMENT); });
+	}
+
+	[[nodiscard]] auto do_is_equal(const std::pmr::memory_resource& other) const noexcept -> bool override {
+		if (this == &other) {
+			return true;
+		}
+		if constexpr (std::equality_comparable<Alloc>) {
+			auto resource = dynamic_cast<const resource_adaptor*>(&other);
+			return resource != nullptr && resource->_alloc == _alloc;
+		} else {
+			return false;
+		}
+	}
+
+	auto allocateRaw(std::size_t bytes, std::size_t alignment) -> void* {
+		if constexpr (UNTYPED) {
+			return _alloc.allocate_bytes(bytes, alignment);
+		} else {
+			return std::allocator_traits<Alloc>::allocate(_alloc, elements(bytes));
+		}
+	}
+
+	void deallocateRaw(void* p, std::size_t bytes, std::size_t alignment) {
+		if constexpr (UNTYPED) {
+			_alloc.deallocate_bytes(p, bytes, alignment);
+		} else {
+			std::allocator_traits<Alloc>::deallocate(_alloc, static_cast<value_type*>(p), elements(bytes));
+		}
+	}
+
+	static constexpr auto elements(std::size_t bytes) -> std::size_t {
+		return std::max((bytes + sizeof(value_type) - 1) / sizeof(value_type), std::size_t{1});
+	}
+
+	Alloc _alloc;
+};
+
+} // namespace allocator
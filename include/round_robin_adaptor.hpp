@@ -1,32 +1,216 @@
 #pragma once
 
 #include "dummy_mutex.hpp"
+#include "statistics.hpp"
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 
 namespace allocator {
 
-template<typename T, typename Mutex = dummy_mutex, typename... Allocs>
-class round_robin_adaptor {
+/*
+	A policy picks the child for every allocation. Its state<N> lives in the adaptor's control block and is shared by all
+	threads, so it keeps its bookkeeping in atomics. pick() gets the size of the request, allocated() and deallocated()
+	report back where the memory went; allocated() gets the time the child took when the state asks for it by TIMED.
+*/
+namespace detail {
+struct balancing_hooks {
+	constexpr static const bool TIMED{false};
+
+	void allocated([[maybe_unused]] std::size_t child, [[maybe_unused]] std::size_t bytes, [[maybe_unused]] std::chrono::nanoseconds took) {
+	}
+
+	void deallocated([[maybe_unused]] std::size_t child, [[maybe_unused]] std::size_t bytes) {
+	}
+};
+} // namespace detail
+
+// Every child in turn, blind to how they are doing
+struct round_robin_policy {
+	template<std::size_t N>
+	struct state : detail::balancing_hooks {
+		std::atomic_uint_least32_t next{0};
+
+		[[nodiscard]] auto pick([[maybe_unused]] std::size_t bytes) -> std::size_t {
+			return next.fetch_add(1, std::memory_order_relaxed) % N;
+		}
+	};
+};
+
+// The child holding the fewest bytes at the moment, so a child whose memory is slow to come back gets less of the new one
+struct least_outstanding_policy {
+	template<std::size_t N>
+	struct state : detail::balancing_hooks {
+		std::array<std::atomic_size_t, N> outstanding{};
+		std::atomic_uint_least32_t        next{0};
+
+		[[nodiscard]] auto pick([[maybe_unused]] std::size_t bytes) -> std::size_t {
+			// The scan starts at a rotating child, so ties do not all land on the first one
+			const std::size_t start = next.fetch_add(1, std::memory_order_relaxed) % N;
+			std::size_t       best  = start;
+			std::size_t       least = outstanding[start].load(std::memory_order_relaxed);
+			for (std::size_t i = 1; i < N; ++i) {
+				const std::size_t child = (start + i) % N;
+				const std::size_t held  = outstanding[child].load(std::memory_order_relaxed);
+				if (held < least) {
+					best  = child;
+					least = held;
+				}
+			}
+			return best;
+		}
+
+		void allocated(std::size_t child, std::size_t bytes, [[maybe_unused]] std::chrono::nanoseconds took) {
+			outstanding[child].fetch_add(bytes, std::memory_order_relaxed);
+		}
+
+		void deallocated(std::size_t child, std::size_t bytes) {
+			outstanding[child].fetch_sub(bytes, std::memory_order_relaxed);
+		}
+	};
+};
+
+// Child i gets Shares[i] of every sum(Shares) allocations, for children of known, unequal speed
+template<std::size_t... Shares>
+struct weighted_policy {
+	template<std::size_t N>
+	struct state : detail::balancing_hooks {
+		static_assert(sizeof...(Shares) == N, "One share per child");
+		static_assert(((Shares > 0) && ...), "Every child needs a share");
+
+		constexpr static const std::size_t                TOTAL{(Shares + ...)};
+		constexpr static const std::array<std::size_t, N> SHARES{Shares...};
+
+		std::atomic_uint_least32_t next{0};
+
+		[[nodiscard]] auto pick([[maybe_unused]] std::size_t bytes) -> std::size_t {
+			std::size_t slot = next.fetch_add(1, std::memory_order_relaxed) % TOTAL;
+			for (std::size_t child = 0; child < N; ++child) {
+				if (slot < SHARES[child]) {
+					return child;
+				}
+				slot -= SHARES[child];
+			}
+			return N - 1;
+		}
+	};
+};
+
+// Every thread sticks to one child, threads are spread over the children in turn. A slow child stalls only its own threads.
+struct thread_affine_policy {
+	template<std::size_t N>
+	struct state : detail::balancing_hooks {
+		inline static std::atomic_size_t threads{0};
+
+		[[nodiscard]] auto pick([[maybe_unused]] std::size_t bytes) -> std::size_t {
+			thread_local const std::size_t slot = threads.fetch_add(1, std::memory_order_relaxed);
+			return slot % N;
+		}
+	};
+};
+
+/*
+	The child with the lowest moving average of allocation latency. Every PROBE-th allocation goes to the children in turn
+	instead, so a child that recovers is noticed again.
+*/
+template<std::size_t PROBE = 64>
+struct latency_feedback_policy {
+	static_assert(PROBE > 0);
+
+	template<std::size_t N>
+	struct state : detail::balancing_hooks {
+		constexpr static const bool TIMED{true};
+
+		std::array<std::atomic_uint_least64_t, N> latency{};
+		std::atomic_uint_least32_t                next{0};
+
+		[[nodiscard]] auto pick([[maybe_unused]] std::size_t bytes) -> std::size_t {
+			const std::size_t ticket = next.fetch_add(1, std::memory_order_relaxed);
+			if (ticket % PROBE == 0) {
+				return ticket / PROBE % N;
+			}
+
+			std::size_t   best    = 0;
+			std::uint64_t fastest = latency[0].load(std::memory_order_relaxed);
+			for (std::size_t child = 1; child < N; ++child) {
+				const std::uint64_t average = latency[child].load(std::memory_order_relaxed);
+				if (average < fastest) {
+					best    = child;
+					fastest = average;
+				}
+			}
+			return best;
+		}
+
+		void allocated(std::size_t child, [[maybe_unused]] std::size_t bytes, std::chrono::nanoseconds took) {
+			// Racing updates may lose a sample, which an average can afford
+			const std::uint64_t average = latency[child].load(std::memory_order_relaxed);
+			const std::uint64_t sample  = static_cast<std::uint64_t>(took.count());
+			latency[child].store(average - average / 8 + sample / 8, std::memory_order_relaxed);
+		}
+	};
+};
+
+// Counts what every child got on top of what Policy decides, balancing_adaptor::stats() reads it
+template<typename Policy>
+struct with_statistics {
+	template<std::size_t N>
+	struct state : Policy::template state<N> {
+		using base = typename Policy::template state<N>;
+
+		std::array<detail::counters<statistics>, N> children;
+
+		void allocated(std::size_t child, std::size_t bytes, std::chrono::nanoseconds took) {
+			base::allocated(child, bytes, took);
+			children[child].allocated(bytes);
+		}
+
+		void deallocated(std::size_t child, std::size_t bytes) {
+			base::deallocated(child, bytes);
+			children[child].deallocated(bytes);
+		}
+	};
+};
+
+/*
+	Hands the allocations to Allocs as the Policy picks them. A child that can tell whether it owns a pointer (owns(p, n),
+	like block_adaptor and mmf_allocator) is simply asked on deallocation, which needs neither bookkeeping nor the Mutex.
+	Only the pointers that no child can claim are recorded in the allocation map under the Mutex.
+*/
+template<typename T, typename Policy, typename Mutex = dummy_mutex, typename... Allocs>
+class balancing_adaptor {
 public:
-	using value_type = T;
+	using value_type  = T;
+	using policy_type = Policy;
 
-	round_robin_adaptor(Allocs&&... allocs) : _p{std::make_shared<ControlBlock>(std::forward<Allocs>(allocs)...)} {
+	balancing_adaptor(Allocs&&... allocs) : _p{std::make_shared<ControlBlock>(std::forward<Allocs>(allocs)...)} {
 	}
 
-	~round_robin_adaptor() = default;
+	~balancing_adaptor() = default;
 
-	round_robin_adaptor(const round_robin_adaptor&)                    = default;
-	round_robin_adaptor(round_robin_adaptor&&)                         = default;
-	auto operator=(const round_robin_adaptor&) -> round_robin_adaptor& = default;
-	auto operator=(round_robin_adaptor&&) -> round_robin_adaptor&      = default;
+	balancing_adaptor(const balancing_adaptor&)                    = default;
+	balancing_adaptor(balancing_adaptor&&)                         = default;
+	auto operator=(const balancing_adaptor&) -> balancing_adaptor& = default;
+	auto operator=(balancing_adaptor&&) -> balancing_adaptor&      = default;
 
 	[[nodiscard]] auto allocate(std::size_t n) -> value_type* {
-		return allocateImpl(next(), n);
+		return allocateImpl(_p->policy.pick(n * sizeof(value_type)), n);
 	}
 
 	void deallocate(value_type* p, std::size_t n) {
+		if (deallocateOwned(p, n)) {
+			return;
+		}
+
 		decltype(_p->allocations.find(p)) it;
 		{
 			std::scoped_lock lock{_p->mutex};
@@ -39,9 +223,61 @@ public:
 		deallocateImpl(it->second, p, n);
 	}
 
+	// Counters of every child, the allocations as a with_statistics policy counted them and the rest from the child's own stats()
+	[[nodiscard]] auto stats() const -> std::array<allocator_stats, sizeof...(Allocs)> {
+		return [this]<std::size_t... Index>(std::index_sequence<Index...>) {
+			return std::array<allocator_stats, sizeof...(Allocs)>{childStats<Index>()...};
+		}(std::index_sequence_for<Allocs...>{});
+	}
+
+	auto operator==(const balancing_adaptor& other) const noexcept -> bool {
+		return _p == other._p;
+	}
+
+	auto operator!=(const balancing_adaptor& other) const noexcept -> bool {
+		return _p != other._p;
+	}
+
 private:
-	[[nodiscard]] auto next() -> std::size_t {
-		return _p->next++ % sizeof...(Allocs);
+	template<typename A>
+	constexpr static const bool CLAIMS = requires(const A& alloc, const value_type* p, std::size_t n) {
+		{ alloc.owns(p, n) } -> std::convertible_to<bool>;
+	};
+
+	// The adaptor sees every allocation of a child, only the child knows what it holds upstream
+	template<std::size_t Index>
+	auto childStats() const -> allocator_stats {
+		allocator_stats result;
+		const auto&     alloc = std::get<Index>(_p->allocs);
+		if constexpr (requires { { alloc.stats() } -> std::convertible_to<allocator_stats>; }) {
+			result = alloc.stats();
+		}
+		if constexpr (requires { _p->policy.children[Index].snapshot(); }) {
+			const auto counted   = _p->policy.children[Index].snapshot();
+			result.allocations   = counted.allocations;
+			result.deallocations = counted.deallocations;
+			result.liveObjects   = counted.liveObjects;
+			result.bytesInUse    = counted.bytesInUse;
+		}
+		return result;
+	}
+
+	// Asks the children that can tell, returns false if none of them owns p
+	template<std::size_t Index = 0>
+	auto deallocateOwned(value_type* p, std::size_t n) -> bool {
+		if constexpr (Index >= sizeof...(Allocs)) {
+			return false;
+		} else {
+			auto& alloc = std::get<Index>(_p->allocs);
+			if constexpr (CLAIMS<std::remove_reference_t<decltype(alloc)>>) {
+				if (alloc.owns(p, n)) {
+					alloc.deallocate(p, n);
+					_p->policy.deallocated(Index, n * sizeof(value_type));
+					return true;
+				}
+			}
+			return deallocateOwned<Index + 1>(p, n);
+		}
 	}
 
 	template<std::size_t Index = 0>
@@ -51,6 +287,7 @@ private:
 		} else {
 			if (Index == allocNo) {
 				std::get<Index>(_p->allocs).deallocate(p, n);
+				_p->policy.deallocated(Index, n * sizeof(value_type));
 				{
 					std::scoped_lock lock{_p->mutex};
 					_p->allocations.erase(p);
@@ -67,7 +304,15 @@ private:
 			throw std::out_of_range{"Index out of range"};
 		} else {
 			if (Index == allocNo) {
-				auto ptr = std::get<Index>(_p->allocs).allocate(n);
+				auto& alloc = std::get<Index>(_p->allocs);
+				auto  start = PolicyState::TIMED ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+				auto  ptr   = alloc.allocate(n);
+				_p->policy.allocated(Index, n * sizeof(value_type), PolicyState::TIMED ? std::chrono::steady_clock::now() - start : std::chrono::nanoseconds{});
+				if constexpr (CLAIMS<std::remove_reference_t<decltype(alloc)>>) {
+					if (alloc.owns(ptr, n)) {
+						return ptr;
+					}
+				}
 				{
 					std::scoped_lock lock{_p->mutex};
 					_p->allocations[ptr] = Index;
@@ -80,9 +325,11 @@ private:
 	}
 
 private:
+	using PolicyState = typename Policy::template state<sizeof...(Allocs)>;
+
 	struct ControlBlock {
 		std::tuple<Allocs...>                        allocs;
-		std::atomic_uint_least32_t                   next{0};
+		PolicyState                                  policy;
 		std::unordered_map<value_type*, std::size_t> allocations;
 		Mutex                                        mutex;
 
@@ -92,4 +339,8 @@ private:
 	std::shared_ptr<ControlBlock> _p;
 };
 
+// The plain round robin, kept under its old name
+template<typename T, typename Mutex = dummy_mutex, typename... Allocs>
+using round_robin_adaptor = balancing_adaptor<T, round_robin_policy, Mutex, Allocs...>;
+
 } // namespace allocator
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+namespace allocator {
+
+// Statistics policies of the allocators, no_statistics compiles every counter out
+struct no_statistics {};
+struct statistics {};
+
+/*
+	Snapshot of the counters of one allocator, as stats() returns it. Blocks are whatever the allocator requests upstream
+	as a whole: pool blocks of block_adaptor, mapped files and segments of mmf_allocator. bytesReserved is what they hold,
+	including the allocations passed to the upstream allocator directly, and peakBytesReserved its high-water mark.
+	The counters are read one by one while other threads may go on, so a free can be seen before its allocation,
+	the derived liveObjects and bytesInUse are clamped at zero then.
+*/
+struct allocator_stats {
+	std::uint64_t allocations{0};
+	std::uint64_t deallocations{0};
+	std::uint64_t liveObjects{0};
+	std::uint64_t bytesInUse{0};
+	std::uint64_t bytesReserved{0};
+	std::uint64_t peakBytesReserved{0};
+	std::uint64_t blocks{0};
+	std::uint64_t upstreamAllocations{0};
+	std::uint64_t upstreamDeallocations{0};
+	std::uint64_t contendedLocks{0};
+
+	// Name and value of every counter, for exporting them to a metrics system
+	[[nodiscard]] auto fields() const -> std::array<std::pair<std::string_view, std::uint64_t>, 10> {
+		return {{
+		    {"allocations", allocations},
+		    {"deallocations", deallocations},
+		    {"live_objects", liveObjects},
+		    {"bytes_in_use", bytesInUse},
+		    {"bytes_reserved", bytesReserved},
+		    {"peak_bytes_reserved", peakBytesReserved},
+		    {"blocks", blocks},
+		    {"upstream_allocations", upstreamAllocations},
+		    {"upstream_deallocations", upstreamDeallocations},
+		    {"contended_locks", contendedLocks},
+		}};
+	}
+
+	// Sums the counters of several allocators, the peaks were not reached at once, so their sum is an upper bound
+	auto operator+=(const allocator_stats& other) -> allocator_stats& {
+		allocations += other.allocations;
+		deallocations += other.deallocations;
+		liveObjects += other.liveObjects;
+		bytesInUse += other.bytesInUse;
+		bytesReserved += other.bytesReserved;
+		peakBytesReserved += other.peakBytesReserved;
+		blocks += other.blocks;
+		upstreamAllocations += other.upstreamAllocations;
+		upstreamDeallocations += other.upstreamDeallocations;
+		contendedLocks += other.contendedLocks;
+		return *this;
+	}
+};
+
+namespace detail {
+// Every call is empty, so the compiler drops the counting along with the member marked [[no_unique_address]]
+template<typename Statistics>
+class counters {
+public:
+	void allocated([[maybe_unused]] std::size_t bytes) noexcept {
+	}
+	void deallocated([[maybe_unused]] std::size_t bytes) noexcept {
+	}
+	void reserved([[maybe_unused]] std::size_t bytes, [[maybe_unused]] bool block) noexcept {
+	}
+	void released([[maybe_unused]] std::size_t bytes, [[maybe_unused]] bool block) noexcept {
+	}
+
+	[[nodiscard]] auto snapshot() const noexcept -> allocator_stats {
+		return {};
+	}
+};
+
+/*
+	Allocations and deallocations are counted by every thread into a stripe of its own, on a cache line no other thread
+	writes as long as there are at most STRIPES threads, and summed on read. Requests to the upstream allocator are rare
+	enough to go to shared counters.
+*/
+template<>
+class counters<statistics> {
+public:
+	void allocated(std::size_t bytes) noexcept {
+		auto& stripe = _stripes[threadStripe()];
+		stripe.allocations.fetch_add(1, std::memory_order_relaxed);
+		stripe.bytesAllocated.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	void deallocated(std::size_t bytes) noexcept {
+		auto& stripe = _stripes[threadStripe()];
+		stripe.deallocations.fetch_add(1, std::memory_order_relaxed);
+		stripe.bytesDeallocated.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	// Upstream requests, block tells whether it is a whole block or a single allocation passed through
+	void reserved(std::size_t bytes, bool block) noexcept {
+		_upstreamAllocations.fetch_add(1, std::memory_order_relaxed);
+		if (block) {
+			_blocks.fetch_add(1, std::memory_order_relaxed);
+		}
+		const auto now  = _reserved.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+		auto       peak = _peak.load(std::memory_order_relaxed);
+		while (peak < now && !_peak.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+		}
+	}
+
+	void released(std::size_t bytes, bool block) noexcept {
+		_upstreamDeallocations.fetch_add(1, std::memory_order_relaxed);
+		if (block) {
+			_blocks.fetch_sub(1, std::memory_order_relaxed);
+		}
+		_reserved.fetch_sub(bytes, std::memory_order_relaxed);
+	}
+
+	[[nodiscard]] auto snapshot() const noexcept -> allocator_stats {
+		allocator_stats result;
+		std::uint64_t   bytesAllocated{0};
+		std::uint64_t   bytesDeallocated{0};
+		for (const auto& stripe : _stripes) {
+			result.allocations += stripe.allocations.load(std::memory_order_relaxed);
+			result.deallocations += stripe.deallocations.load(std::memory_order_relaxed);
+			bytesAllocated += stripe.bytesAllocated.load(std::memory_order_relaxed);
+			bytesDeallocated += stripe.bytesDeallocated.load(std::memory_order_relaxed);
+		}
+		result.liveObjects           = result.allocations - std::min(result.deallocations, result.allocations);
+		result.bytesInUse            = bytesAllocated - std::min(bytesDeallocated, bytesAllocated);
+		result.bytesReserved         = _reserved.load(std::memory_order_relaxed);
+		result.peakBytesReserved     = _peak.load(std::memory_order_relaxed);
+		result.blocks                = _blocks.load(std::memory_order_relaxed);
+		result.upstreamAllocations   = _upstreamAllocations.load(std::memory_order_relaxed);
+		result.upstreamDeallocations = _upstreamDeallocations.load(std::memory_order_relaxed);
+		return result;
+	}
+
+private:
+	constexpr static const std::size_t STRIPES{16};
+
+	struct alignas(64) Stripe {
+		std::atomic_uint64_t allocations{0};
+		std::atomic_uint64_t deallocations{0};
+		std::atomic_uint64_t bytesAllocated{0};
+		std::atomic_uint64_t bytesDeallocated{0};
+	};
+
+	// Threads take the stripes in turn as they count for the first time
+	static auto threadStripe() noexcept -> std::size_t {
+		thread_local const std::size_t stripe = nextStripe.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+		return stripe;
+	}
+
+	inline static std::atomic_size_t nextStripe{0};
+
+	std::array<Stripe, STRIPES> _stripes{};
+	std::atomic_uint64_t        _reserved{0};
+	std::atomic_uint64_t        _peak{0};
+	std::atomic_uint64_t        _blocks{0};
+	std::atomic_uint64_t        _upstreamAllocations{0};
+	std::atomic_uint64_t        _upstreamDeallocations{0};
+};
+
+// The Mutex of an allocator, with statistics it counts how often it was found taken
+template<typename Mutex, typename Statistics>
+struct counted_mutex : Mutex {
+	[[nodiscard]] auto contended() const noexcept -> std::uint64_t {
+		return 0;
+	}
+};
+
+template<typename Mutex>
+struct counted_mutex<Mutex, statistics> : Mutex {
+	void lock() {
+		if (!Mutex::try_lock()) {
+			_contended.fetch_add(1, std::memory_order_relaxed);
+			Mutex::lock();
+		}
+	}
+
+	[[nodiscard]] auto contended() const noexcept -> std::uint64_t {
+		return _contended.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic_uint64_t _contended{0};
+};
+} // namespace detail
+
+} // namespace allocator
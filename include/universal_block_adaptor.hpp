@@ -1,46 +1,165 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <bit>
 #include <cmath>
 #include <cstddef>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#if defined(__linux__)
+#	include <sched.h>
+#endif
 
 #include "block_adaptor.hpp"
 #include "dummy_mutex.hpp"
+#include "over_aligned.hpp"
+#include "statistics.hpp"
 
 namespace allocator {
 
+namespace detail {
+// Lives outside of universal_block_adaptor, so that all rebound adaptors share the very same pool types
+// Aligned to the biggest power of two dividing the size, so every cell of a pool is aligned the same way
+template<std::size_t ObjectSize>
+struct alignas(ObjectSize & (~ObjectSize + 1)) Filler {
+	std::array<std::byte, ObjectSize> _data;
+	static_assert(sizeof(_data) == ObjectSize, "Filler size is not correct");
+};
+
+// Shared by all rebound adaptors, every shard has pools of all the size classes, large allocations bypass them
+template<typename Classes, typename LargeAlloc, std::size_t SHARDS, typename Statistics>
+struct Pools {
+	std::array<Classes, SHARDS> shards;
+	LargeAlloc                  large{};
+
+	[[no_unique_address]] counters<Statistics> largeStats;
+};
+
+// CPU the calling thread runs on. Recent glibc reads it from the rseq area without a system call.
+// Where there is no such call the threads spread over the shards by their ids.
+inline auto currentCpu() -> std::size_t {
+#if defined(__linux__)
+	if (const auto cpu = sched_getcpu(); cpu >= 0) {
+		return static_cast<std::size_t>(cpu);
+	}
+#endif
+	thread_local const auto id = std::hash<std::thread::id>{}(std::this_thread::get_id());
+	return id;
+}
+
+constexpr auto roundToPointer(std::size_t size) -> std::size_t {
+	return std::max((size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*), sizeof(void*));
+}
+} // namespace detail
+
+/*
+	Splits every doubling of the cell size into STEPS size classes, starting at sizeof(void*) and covering DOUBLINGS doublings.
+	With STEPS = 4 a 72 byte object takes an 80 byte cell instead of a 128 byte one. Sizes are multiples of sizeof(void*).
+*/
+template<std::size_t STEPS = 1>
+struct geometric_size_classes {
+	static_assert(STEPS > 0, "every doubling needs at least one size class");
+
+	template<std::size_t DOUBLINGS>
+	static constexpr auto sizes() {
+		constexpr auto generated = generate<DOUBLINGS>();
+		std::array<std::size_t, generated.second> result{};
+		std::copy_n(generated.first.begin(), result.size(), result.begin());
+		return result;
+	}
+
+private:
+	template<std::size_t DOUBLINGS>
+	static constexpr auto generate() {
+		std::array<std::size_t, DOUBLINGS * STEPS + 1> all{};
+		std::size_t                                    count{0};
+		all[count++] = sizeof(void*);
+		for (std::size_t doubling{1}; doubling < DOUBLINGS; ++doubling) {
+			const auto base = sizeof(void*) << (doubling - 1);
+			for (std::size_t step{1}; step <= STEPS; ++step) {
+				if (const auto size = detail::roundToPointer(base + base * step / STEPS); size > all[count - 1]) {
+					all[count++] = size;
+				}
+			}
+		}
+		return std::pair{all, count};
+	}
+};
+
+// User supplied size classes in ascending order, rounded up to multiples of sizeof(void*)
+template<std::size_t... SIZES>
+struct size_class_list {
+	static_assert(sizeof...(SIZES) > 0, "at least one size class is needed");
+
+	template<std::size_t>
+	static constexpr auto sizes() {
+		return std::array<std::size_t, sizeof...(SIZES)>{detail::roundToPointer(SIZES)...};
+	}
+};
+
 /*
 	This universal allocator has a series of allocators for different sizes of objects.
 	It uses the smallest allocator that can fit the object.
-	It is not thread safe.
-	It starts with objects of size sizeof(void*) bytes (8B on 64-bit systems) and doubles the size
-	until it reaches the number of blocks specified in the template parameter.
+	It is as thread safe as its Mutex, which guards every pool, so with the default dummy_mutex it is for a single thread.
+	SizeClasses gives the cell sizes. By default it starts with objects of size sizeof(void*) bytes (8B on 64-bit systems)
+	and doubles the size SUBALLOCATORS times, so an object just past a power of two wastes almost half of its cell.
+	geometric_size_classes with more STEPS or a size_class_list cut that down at the cost of more pools.
+	A type takes the smallest class that fits it and is a multiple of its alignment, chosen at compile time.
+	Arrays take the class that fits the whole array, chosen at run time. Objects and arrays bigger than the largest class
+	are requested from Alloc directly.
+	MAGAZINE_SIZE is passed to every block_adaptor, see block_adaptor for the per-thread cache.
+	The release_policy applies to every size class separately.
+	SHARDS > 1 gives every size class that many pools and a cell is taken from the pool of the CPU the thread runs on,
+	so threads on different CPUs almost never meet on a lock. Only when that pool can not get memory from Alloc the other
+	shards are tried in turn. A cell is freed to the shard owning it, which is the local one unless the thread migrated.
+	Every shard grows its own blocks, so the pools may hold up to SHARDS times the memory of a single one.
+	All the shards make one allocator, rebound copies share them and compare equal.
+	Statistics is passed to every block_adaptor as well, stats() sums each size class over the shards.
 */
 template<
     typename T                           = std::byte,
     std::size_t SUBALLOCATORS            = 6UZ,
     std::size_t BLOCK_SIZE               = 4UZ * 1024 * 1024,
     template<typename...> typename Alloc = std::allocator,
-    typename Mutex                       = dummy_mutex>
+    typename Mutex                       = dummy_mutex,
+    std::size_t MAGAZINE_SIZE            = 0,
+    typename SizeClasses                 = geometric_size_classes<>,
+    std::size_t SHARDS                   = 1,
+    typename Statistics                  = no_statistics>
 struct universal_block_adaptor {
-	template<typename, std::size_t, std::size_t, template<typename...> typename, typename>
+	template<typename, std::size_t, std::size_t, template<typename...> typename, typename, std::size_t, typename, std::size_t, typename>
 	friend struct universal_block_adaptor;
 
 	using value_type = T;
 
+	constexpr static const auto SIZES = SizeClasses::template sizes<SUBALLOCATORS>();
+
+	static_assert(std::is_sorted(SIZES.begin(), SIZES.end()), "size classes must be in ascending order");
+	static_assert(SHARDS > 0, "at least one shard is needed");
+
 	template<typename U>
 	struct rebind {
-		using other = universal_block_adaptor<U, SUBALLOCATORS>;
+		using other = universal_block_adaptor<U, SUBALLOCATORS, BLOCK_SIZE, Alloc, Mutex, MAGAZINE_SIZE, SizeClasses, SHARDS, Statistics>;
 	};
 
-	universal_block_adaptor() : _alloc{std::make_shared<allocator_tuple_type>()} {
+	universal_block_adaptor() : _alloc{std::make_shared<Pools>()} {
+	}
+
+	explicit universal_block_adaptor(release_policy policy) : _alloc{makePools(policy, std::make_index_sequence<SIZES.size()>{})} {
 	}
 
 	template<typename U = void>
-	explicit universal_block_adaptor(const universal_block_adaptor<U, SUBALLOCATORS>& other)
-	    : _alloc{*reinterpret_cast<const decltype(_alloc)*>(&other._alloc)} {
+	explicit universal_block_adaptor(
+	    const universal_block_adaptor<U, SUBALLOCATORS, BLOCK_SIZE, Alloc, Mutex, MAGAZINE_SIZE, SizeClasses, SHARDS, Statistics>& other)
+	    : _alloc{other._alloc} {
 	}
 
 	template<typename U, typename... Args>
@@ -49,36 +168,130 @@ struct universal_block_adaptor {
 	}
 
 	[[nodiscard]] auto allocate(std::size_t n) -> value_type* {
-		return allocator<value_type>().allocate(n);
+		if constexpr (posForType<value_type>() < SIZES.size()) {
+			if (n == 1) {
+				return reinterpret_cast<value_type*>(allocateCell<posForType<value_type>()>(*_alloc));
+			}
+		}
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(value_type)) {
+			throw std::bad_array_new_length();
+		}
+		return static_cast<value_type*>(allocate_bytes(n * sizeof(value_type), alignof(value_type)));
 	}
 
 	void deallocate(value_type* p, std::size_t n) noexcept {
-		allocator<value_type>().deallocate(p, n);
+		if constexpr (posForType<value_type>() < SIZES.size()) {
+			if (n == 1) {
+				deallocateCell<posForType<value_type>()>(*_alloc, p);
+				return;
+			}
+		}
+		deallocate_bytes(p, n * sizeof(value_type), alignof(value_type));
 	}
 
-private:
-	template<std::size_t ObjectSize>
-	struct Filler {
-		std::array<std::byte, ObjectSize> _data;
-		static_assert(sizeof(_data) == ObjectSize, "Filler size is not correct");
-	};
+	// Untyped allocation, the size class is looked up at run time
+	[[nodiscard]] auto allocate_bytes(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) -> void* {
+		if (const auto pos = posFromSize(bytes, alignment); pos < SIZES.size()) {
+			return ALLOCATE[pos](*_alloc);
+		}
+		if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+			auto p = std::allocator_traits<large_alloc_type>::allocate(_alloc->large, bytes);
+			_alloc->largeStats.allocated(bytes);
+			_alloc->largeStats.reserved(bytes, false);
+			return p;
+		}
+
+		// Alloc knows nothing about the alignment
+		auto p = detail::allocateOverAligned(bytes, alignment, [this](std::size_t size) {
+			return std::allocator_traits<large_alloc_type>::allocate(_alloc->large, size);
+		});
+		_alloc->largeStats.allocated(bytes);
+		_alloc->largeStats.reserved(detail::overAlignedSize(bytes, alignment), false);
+		return p;
+	}
 
-	static constexpr auto cellSize(std::size_t bytes) -> std::size_t {
-		return std::max(std::bit_ceil(bytes), sizeof(void*));
+	void deallocate_bytes(void* p, std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) noexcept {
+		if (const auto pos = posFromSize(bytes, alignment); pos < SIZES.size()) {
+			DEALLOCATE[pos](*_alloc, p);
+			return;
+		}
+		_alloc->largeStats.deallocated(bytes);
+		if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+			std::allocator_traits<large_alloc_type>::deallocate(_alloc->large, static_cast<std::byte*>(p), bytes);
+			_alloc->largeStats.released(bytes, false);
+			return;
+		}
+
+		detail::deallocateOverAligned(p, bytes, alignment, [this](void* base, std::size_t size) {
+			std::allocator_traits<large_alloc_type>::deallocate(_alloc->large, static_cast<std::byte*>(base), size);
+		});
+		_alloc->largeStats.released(detail::overAlignedSize(bytes, alignment), false);
+	}
+
+	// Hands completely free blocks of all size classes back to Alloc, returns the number of released blocks
+	auto trim() -> std::size_t {
+		std::size_t released{0};
+		for (auto& classes : _alloc->shards) {
+			released += std::apply([](auto&... pool) { return (pool.trim() + ...); }, classes);
+		}
+		return released;
+	}
+
+	// Counters of every size class summed over the shards, the last entry counts the allocations bigger than any class
+	[[nodiscard]] auto stats() const -> std::array<allocator_stats, SIZES.size() + 1> {
+		std::array<allocator_stats, SIZES.size() + 1> result{};
+		for (const auto& classes : _alloc->shards) {
+			std::apply([&result](const auto&... pool) {
+				std::size_t pos{0};
+				((result[pos++] += pool.stats()), ...);
+			}, classes);
+		}
+		result.back() = _alloc->largeStats.snapshot();
+		return result;
+	}
+
+	template<typename U>
+	auto operator==(
+	    const universal_block_adaptor<U, SUBALLOCATORS, BLOCK_SIZE, Alloc, Mutex, MAGAZINE_SIZE, SizeClasses, SHARDS, Statistics>& other) const -> bool {
+		return _alloc == other._alloc;
 	}
 
 	template<typename U>
-	static constexpr auto cellSize() -> std::size_t {
-		return cellSize(sizeof(U));
+	auto operator!=(
+	    const universal_block_adaptor<U, SUBALLOCATORS, BLOCK_SIZE, Alloc, Mutex, MAGAZINE_SIZE, SizeClasses, SHARDS, Statistics>& other) const -> bool {
+		return _alloc != other._alloc;
 	}
 
-	static constexpr auto posFromSize(std::size_t size) -> std::size_t {
-		return std::bit_width(cellSize(size)) - std::bit_width(cellSize(0));
+private:
+	// Smallest class of at least i * sizeof(void*) bytes, all the classes are multiples of sizeof(void*)
+	constexpr static const auto CLASS_OF = [] {
+		std::array<std::uint_least8_t, SIZES.back() / sizeof(void*) + 1> classes{};
+		for (std::size_t i{0}, pos{0}; i < classes.size(); ++i) {
+			while (SIZES[pos] < i * sizeof(void*)) {
+				++pos;
+			}
+			classes[i] = static_cast<std::uint_least8_t>(pos);
+		}
+		return classes;
+	}();
+
+	static_assert(SIZES.size() <= std::numeric_limits<std::uint_least8_t>::max(), "too many size classes");
+
+	// One table lookup, only alignments above sizeof(void*) that the class does not meet walk on to a bigger class
+	static constexpr auto posFromSize(std::size_t size, std::size_t align) -> std::size_t {
+		if (size > SIZES.back()) {
+			return SIZES.size();
+		}
+		std::size_t pos = CLASS_OF[(size + sizeof(void*) - 1) / sizeof(void*)];
+		while (pos < SIZES.size() && SIZES[pos] % align != 0) {
+			++pos;
+		}
+		return pos;
 	}
 
 	template<typename U>
 	static constexpr auto posForType() -> std::size_t {
-		return posFromSize(sizeof(U));
+		return posFromSize(sizeof(U), alignof(U));
 	}
 
 	static constexpr auto blockSizeForCellSize(std::size_t size) -> std::size_t {
@@ -87,34 +300,85 @@ private:
 		return elements * size;
 	}
 
-	template<typename U>
-	using filler_allocator_type = block_adaptor<Filler<cellSize(sizeof(U))>, BLOCK_SIZE, Alloc, Mutex>;
+	template<std::size_t... Index>
+	static auto helper(std::index_sequence<Index...>) {
+		return std::tuple<block_adaptor<detail::Filler<SIZES[Index]>, BLOCK_SIZE, Alloc, Mutex, MAGAZINE_SIZE, locked_free_list, Statistics>...>{};
+	}
 
-	template<typename U>
-	auto allocator() -> block_adaptor<U, BLOCK_SIZE, Alloc, Mutex>& {
-		static_assert(posForType<U>() < SUBALLOCATORS, "type too big for a allocator");
-		return *reinterpret_cast<block_adaptor<U, BLOCK_SIZE, Alloc, Mutex>*>(&std::get<posForType<U>()>(*_alloc));
+	using allocator_tuple_type = decltype(helper(std::make_index_sequence<SIZES.size()>{}));
+	using large_alloc_type     = Alloc<std::byte>;
+	using Pools                = detail::Pools<allocator_tuple_type, large_alloc_type, SHARDS, Statistics>;
+
+	static auto currentShard() -> std::size_t {
+		return detail::currentCpu() % SHARDS;
+	}
+
+	// Every type of the same cell size shares one pool, so the cells are always carved by the Filler allocator
+	// The shard of the current CPU serves the cell, the others step in only once it can not get memory
+	template<std::size_t Index>
+	static auto allocateCell(Pools& pools) -> void* {
+		if constexpr (SHARDS == 1) {
+			return std::get<Index>(pools.shards[0]).allocate(1);
+		} else {
+			const auto home = currentShard();
+			try {
+				return std::get<Index>(pools.shards[home]).allocate(1);
+			} catch (const std::bad_alloc&) {
+				for (std::size_t i{1}; i < SHARDS; ++i) {
+					try {
+						return std::get<Index>(pools.shards[(home + i) % SHARDS]).allocate(1);
+					} catch (const std::bad_alloc&) {
+					}
+				}
+				throw;
+			}
+		}
+	}
+
+	// Cells are mostly freed on the CPU that took them, otherwise the owning shard is found by lock-free lookups
+	template<std::size_t Index>
+	static void deallocateCell(Pools& pools, void* p) noexcept {
+		using cell_type = typename std::tuple_element_t<Index, allocator_tuple_type>::value_type;
+		auto cell       = static_cast<cell_type*>(p);
+		if constexpr (SHARDS == 1) {
+			std::get<Index>(pools.shards[0]).deallocate(cell, 1);
+		} else {
+			const auto home = currentShard();
+			for (std::size_t i{0}; i < SHARDS; ++i) {
+				auto& pool = std::get<Index>(pools.shards[(home + i) % SHARDS]);
+				if (i + 1 == SHARDS || pool.owns(cell, 1)) {
+					pool.deallocate(cell, 1);
+					return;
+				}
+			}
+		}
 	}
 
+	// Tables of the pools by class, so the run time dispatch is a single indirect call
 	template<std::size_t... Index>
-	static auto helper(std::index_sequence<Index...>) {
-		return std::tuple<block_adaptor<Filler<cellSize(1 << (std::bit_width(sizeof(void*)) + Index - 1))>, BLOCK_SIZE, Alloc, Mutex>...>{};
+	static constexpr auto allocateTable(std::index_sequence<Index...>) {
+		return std::array<void* (*)(Pools&), sizeof...(Index)>{&allocateCell<Index>...};
+	}
+
+	template<std::size_t... Index>
+	static constexpr auto deallocateTable(std::index_sequence<Index...>) {
+		return std::array<void (*)(Pools&, void*) noexcept, sizeof...(Index)>{&deallocateCell<Index>...};
 	}
 
-	using allocator_tuple_type = decltype(helper(std::make_index_sequence<SUBALLOCATORS>{}));
+	constexpr static const auto ALLOCATE   = allocateTable(std::make_index_sequence<SIZES.size()>{});
+	constexpr static const auto DEALLOCATE = deallocateTable(std::make_index_sequence<SIZES.size()>{});
+
+	template<std::size_t... Index>
+	static auto makePools(release_policy policy, std::index_sequence<Index...>) -> std::shared_ptr<Pools> {
+		auto pools = std::make_shared<Pools>();
+		for (auto& classes : pools->shards) {
+			classes = allocator_tuple_type{std::tuple_element_t<Index, allocator_tuple_type>{{}, policy}...};
+		}
+		return pools;
+	}
 
 private:
-	std::shared_ptr<allocator_tuple_type> _alloc;
+	std::shared_ptr<Pools> _alloc;
 };
 
-template<typename T, typename U, std::size_t SUBALLOCATORS>
-auto operator==(const universal_block_adaptor<T, SUBALLOCATORS>& a, const universal_block_adaptor<U, SUBALLOCATORS>& b) -> bool {
-	return a._alloc == b._alloc;
-}
-
-template<typename T, typename U, std::size_t SUBALLOCATORS>
-auto operator!=(const universal_block_adaptor<T, SUBALLOCATORS>& a, const universal_block_adaptor<U, SUBALLOCATORS>& b) -> bool {
-	return a._alloc != b._alloc;
-}
-
 } // namespace allocator
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace benchmark {
+
+/*
+	Log-linear histogram of latencies in the manner of HdrHistogram. Every power of two of nanoseconds is split into
+	SUB_BUCKETS linear buckets, so a recorded value is off by at most 1 / SUB_BUCKETS of itself, and values below
+	2 * SUB_BUCKETS are exact. Recording is a bit scan and an increment, so every thread keeps a histogram of its own
+	and they are merged once the threads are done. The maximum is kept exactly.
+*/
+class latency_histogram {
+public:
+	using duration = std::chrono::nanoseconds;
+
+	void record(duration latency) noexcept {
+		const auto value = static_cast<std::uint64_t>(std::max(latency.count(), duration::rep{0}));
+		++_counts[index(value)];
+		++_total;
+		_max = std::max(_max, value);
+	}
+
+	void merge(const latency_histogram& other) noexcept {
+		for (std::size_t i{0}; i < BUCKETS; ++i) {
+			_counts[i] += other._counts[i];
+		}
+		_total += other._total;
+		_max = std::max(_max, other._max);
+	}
+
+	// The highest value of the bucket holding the given fraction of the recorded values, 0.99 for p99
+	[[nodiscard]] auto percentile(double fraction) const noexcept -> duration {
+		if (_total == 0) {
+			return duration{0};
+		}
+		const auto    rank = std::max(static_cast<std::uint64_t>(std::ceil(fraction * static_cast<double>(_total))), std::uint64_t{1});
+		std::uint64_t seen{0};
+		for (std::size_t i{0}; i < BUCKETS; ++i) {
+			if ((seen += _counts[i]) >= rank) {
+				return duration{static_cast<duration::rep>(std::min(highest(i), _max))};
+			}
+		}
+		return max();
+	}
+
+	[[nodiscard]] auto max() const noexcept -> duration {
+		return duration{static_cast<duration::rep>(_max)};
+	}
+
+	[[nodiscard]] auto count() const noexcept -> std::uint64_t {
+		return _total;
+	}
+
+private:
+	constexpr static const std::size_t SUB_BUCKET_BITS{5};
+	constexpr static const std::size_t SUB_BUCKETS{1UZ << SUB_BUCKET_BITS};
+	constexpr static const std::size_t BUCKETS{(64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS};
+
+	// Values of [2^(b+s), 2^(b+s+1)) are shifted right by s, which leaves them in the upper half of the linear range
+	static constexpr auto shift(std::uint64_t value) noexcept -> std::size_t {
+		const auto width = static_cast<std::size_t>(std::bit_width(value));
+		return width > SUB_BUCKET_BITS + 1 ? width - SUB_BUCKET_BITS - 1 : 0;
+	}
+
+	static constexpr auto index(std::uint64_t value) noexcept -> std::size_t {
+		const auto s = shift(value);
+		return s * SUB_BUCKETS + static_cast<std::size_t>(value >> s);
+	}
+
+	static constexpr auto highest(std::size_t bucket) noexcept -> std::uint64_t {
+		const std::size_t s = bucket < 2 * SUB_BUCKETS ? 0 : bucket / SUB_BUCKETS - 1;
+		return ((static_cast<std::uint64_t>(bucket - s * SUB_BUCKETS) + 1) << s) - 1;
+	}
+
+	std::array<std::uint64_t, BUCKETS> _counts{};
+	std::uint64_t                      _total{0};
+	std::uint64_t                      _max{0};
+};
+
+} // namespace benchmark
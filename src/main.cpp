@@ -1,5 +1,10 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <barrier>
+#include <cassert>
 #include <chrono>
+#include <cstdint>
 #include <deque>
 #include <format>
 #include <forward_list>
@@ -8,8 +13,11 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <memory_resource>
 #include <ranges>
 #include <set>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
@@ -19,9 +27,13 @@
 #include "block_adaptor.hpp"
 #include "mallocator.hpp"
 #include "mmf_allocator.hpp"
+#include "offset_ptr.hpp"
+#include "resource_adaptor.hpp"
 #include "round_robin_adaptor.hpp"
 #include "universal_block_adaptor.hpp"
 
+#include "latency_histogram.hpp"
+#include "perf_counters.hpp"
 #include "pretty_name.hpp"
 
 constexpr auto repeat(std::size_t n) {
@@ -30,38 +42,149 @@ constexpr auto repeat(std::size_t n) {
 
 constexpr auto DEFAULT_REPETITIONS = 1'000'000;
 
+// What a benchmark run measured: the wall time, the latency of every single operation and the counters of the whole run
+struct benchmark_result {
+	std::chrono::microseconds        total{};
+	benchmark::latency_histogram     allocate;
+	benchmark::latency_histogram     deallocate;
+	benchmark::perf_counters::values counters{};
+
+	void merge(const benchmark_result& other) noexcept {
+		allocate.merge(other.allocate);
+		deallocate.merge(other.deallocate);
+	}
+};
+
+auto percentiles(const benchmark::latency_histogram& histogram) -> std::string {
+	return std::format("{}/{}/{}/{}", histogram.percentile(0.5), histogram.percentile(0.99), histogram.percentile(0.999), histogram.max());
+}
+
+// One line of total, p50/p99/p99.9/max of allocations and deallocations, and the counters, "-" for those not available
+template<>
+struct std::formatter<benchmark_result> : std::formatter<std::string_view> {
+	auto format(const benchmark_result& result, std::format_context& ctx) const {
+		auto counter = [&result](benchmark::perf_counters::counter which) {
+			const auto& value = result.counters[which];
+			return value ? std::to_string(*value) : std::string{"-"};
+		};
+		const auto line = std::format("{} alloc {} free {} cache-misses {} page-faults {} context-switches {}",
+		                              result.total,
+		                              percentiles(result.allocate),
+		                              percentiles(result.deallocate),
+		                              counter(benchmark::perf_counters::cache_misses),
+		                              counter(benchmark::perf_counters::page_faults),
+		                              counter(benchmark::perf_counters::context_switches));
+		return std::formatter<std::string_view>::format(line, ctx);
+	}
+};
+
+// Starts the threads with the counters running and gathers their latencies once they are done
+template<typename Start>
+auto run_benchmark(std::size_t threads, Start start) -> benchmark_result {
+	std::vector<benchmark_result> latencies(threads);
+	benchmark_result              result;
+	benchmark::perf_counters      counters;
+
+	counters.start();
+	const auto begin = std::chrono::high_resolution_clock::now();
+	{
+		std::vector<std::jthread> running;
+		for (auto t : repeat(threads)) {
+			running.push_back(start(t, latencies[t]));
+		}
+	}
+	const auto end = std::chrono::high_resolution_clock::now();
+	counters.stop();
+
+	result.total    = std::chrono::duration_cast<std::chrono::microseconds>(end - begin);
+	result.counters = counters.read();
+	for (const auto& mine : latencies) {
+		result.merge(mine);
+	}
+	return result;
+}
+
 template<typename T>
-auto parallel_test(T& alloc, std::size_t repetitions = DEFAULT_REPETITIONS) -> std::chrono::microseconds {
-	const auto concurrency = 4 * std::thread::hardware_concurrency(); // Make sure there is a lot of contention, context switches and cache misses
+auto parallel_test(T& alloc, std::size_t repetitions = DEFAULT_REPETITIONS, unsigned threadsPerCore = 4) -> benchmark_result {
+	// By default make sure there is a lot of contention, context switches and cache misses
+	const auto concurrency = threadsPerCore * std::thread::hardware_concurrency();
 
-	std::barrier              b{concurrency};
-	std::vector<std::jthread> threads;
+	std::barrier b{concurrency};
 
-	auto func = [=, &alloc, &b] {
+	auto func = [=, &alloc, &b](benchmark_result& mine) {
+		using clock = std::chrono::high_resolution_clock;
 		std::vector<std::size_t*> v;
 
 		b.arrive_and_wait();
 		for ([[maybe_unused]] auto i : repeat(repetitions / concurrency)) {
-			auto p = alloc.allocate(1);
-			*p     = i;
+			auto before = clock::now();
+			auto p      = alloc.allocate(1);
+			mine.allocate.record(clock::now() - before);
+			*p = i;
 			v.push_back(p);
 		}
 		b.arrive_and_wait();
 		for (auto p : v) {
+			auto before = clock::now();
 			alloc.deallocate(p, 1);
+			mine.deallocate.record(clock::now() - before);
 		}
 	};
 
-	auto start = std::chrono::high_resolution_clock::now();
-	for ([[maybe_unused]] auto i : repeat(concurrency)) {
-		threads.emplace_back(func);
-	}
+	return run_benchmark(concurrency, [&](std::size_t, benchmark_result& mine) { return std::jthread{func, std::ref(mine)}; });
+}
 
-	for (auto& thread : threads) {
-		thread.join();
-	}
-	auto end = std::chrono::high_resolution_clock::now();
-	return std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+template<typename T>
+auto producer_consumer_test(T& alloc, std::size_t repetitions = DEFAULT_REPETITIONS) -> benchmark_result {
+	// Every producer allocates messages and passes them through its own ring to a consumer, which frees them
+	const auto pairs = std::max(std::thread::hardware_concurrency() / 2, 1U);
+
+	struct Ring {
+		std::array<std::atomic<std::size_t*>, 1024> slots{};
+	};
+
+	std::vector<Ring> rings(pairs);
+	std::barrier      b{2 * pairs};
+
+	auto producer = [=, &alloc, &b](Ring& ring, benchmark_result& mine) {
+		using clock = std::chrono::high_resolution_clock;
+		b.arrive_and_wait();
+		for (auto i : repeat(repetitions / pairs)) {
+			auto before = clock::now();
+			auto p      = alloc.allocate(1);
+			mine.allocate.record(clock::now() - before);
+			*p = i;
+
+			auto& slot = ring.slots[i % ring.slots.size()];
+			while (slot.load(std::memory_order_acquire) != nullptr) {
+				std::this_thread::yield();
+			}
+			slot.store(p, std::memory_order_release);
+		}
+	};
+
+	auto consumer = [=, &alloc, &b](Ring& ring, benchmark_result& mine) {
+		using clock = std::chrono::high_resolution_clock;
+		b.arrive_and_wait();
+		for (auto i : repeat(repetitions / pairs)) {
+			auto&        slot = ring.slots[i % ring.slots.size()];
+			std::size_t* p{nullptr};
+			while ((p = slot.load(std::memory_order_acquire)) == nullptr) {
+				std::this_thread::yield();
+			}
+			slot.store(nullptr, std::memory_order_release);
+
+			auto before = clock::now();
+			alloc.deallocate(p, 1);
+			mine.deallocate.record(clock::now() - before);
+		}
+	};
+
+	// Even threads produce into the ring of their pair, odd ones consume from it
+	return run_benchmark(2 * pairs, [&](std::size_t t, benchmark_result& mine) {
+		auto& ring = rings[t / 2];
+		return t % 2 == 0 ? std::jthread{producer, std::ref(ring), std::ref(mine)} : std::jthread{consumer, std::ref(ring), std::ref(mine)};
+	});
 }
 
 void mallocator() {
@@ -129,17 +252,169 @@ void mmf_allocator() {
 
 	std::cout << std::format("{:=^80}", "- mmf_allocator parallel test -") << std::endl;
 	std::cout << std::format("{}", parallel_test(ap, 1000)) << std::endl;
+
+	std::cout << "In the arena mode the allocations share big sparse segment files, so the directory holds a single file instead of thousands and "
+	             "freed ranges are reused."
+	          << std::endl;
+	allocator::mmf_allocator<std::size_t, active_mutex> aa{std::filesystem::current_path() / "mmfa", {.arena = true}};
+
+	std::cout << std::format("{:=^80}", "- mmf_allocator arena parallel test -") << std::endl;
+	std::cout << std::format("{}", parallel_test(aa, 1000)) << std::endl;
+
+	std::cout << "Without a directory the files are anonymous and vanish with their last mapping. The memfd option keeps them in memory, "
+	             "location() tells the descriptor and the offset to hand to another process that wants to map the same memory."
+	          << std::endl;
+	allocator::mmf_allocator<std::size_t, active_mutex> am{"", {.memfd = true}};
+
+	std::cout << std::format("{:=^80}", "- mmf_allocator memfd parallel test -") << std::endl;
+	std::cout << std::format("{}", parallel_test(am, 1000)) << std::endl;
+
+	std::cout << "The hints tell the kernel how the memory is going to be used. Streaming through a fresh buffer pays a page fault for every "
+	             "page, unless the pages are populated when the buffer is allocated."
+	          << std::endl;
+	std::cout << std::format("{:=^80}", "- mmf_allocator hints test -") << std::endl;
+	for (const bool populate : {false, true}) {
+		constexpr std::size_t                               count = 64 * 1024 * 1024 / sizeof(std::size_t);
+		const allocator::mmf_hints                          hints{.access = allocator::mmf_access::sequential, .populate = populate};
+		allocator::mmf_allocator<std::size_t, active_mutex> ah{"", {.memfd = true, .hints = hints}};
+
+		auto start  = std::chrono::high_resolution_clock::now();
+		auto buffer = ah.allocate(count);
+		for (auto i : repeat(count)) {
+			buffer[i] = i;
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		ah.deallocate(buffer, count);
+		std::cout << std::format("{:<28}{}", populate ? "populated" : "faulted on touch", std::chrono::duration_cast<std::chrono::microseconds>(end - start))
+		          << std::endl;
+	}
+
+	std::cout << "Churning through the same size again and again creates and deletes a file every time, unless the released mappings are "
+	             "recycled."
+	          << std::endl;
+	std::cout << std::format("{:=^80}", "- mmf_allocator recycling test -") << std::endl;
+	for (const std::size_t cache : {0UZ, 16UZ * 1024 * 1024}) {
+		constexpr std::size_t                 count = 4096 / sizeof(std::size_t);
+		allocator::mmf_allocator<std::size_t> ar{std::filesystem::current_path() / "mmfr", {.recycling = {.maxBytes = cache}}};
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (auto i : repeat(1000)) {
+			auto p = ar.allocate(count);
+			*p     = i;
+			ar.deallocate(p, count);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		std::cout << std::format("{:<28}{}", cache == 0 ? "no recycling" : "recycling", std::chrono::duration_cast<std::chrono::microseconds>(end - start))
+		          << std::endl;
+	}
+
+	std::cout << "The writeback pushes the dirty pages to the disk steadily in the background, instead of letting them pile up until the kernel "
+	             "stalls the producers. flush() writes everything back right away."
+	          << std::endl;
+	std::cout << std::format("{:=^80}", "- mmf_allocator writeback usage -") << std::endl;
+	{
+		using namespace std::chrono_literals;
+		constexpr std::size_t                               count = 64 * 1024 * 1024 / sizeof(std::size_t);
+		allocator::mmf_allocator<std::size_t, active_mutex> aw{
+		    std::filesystem::current_path() / "mmfw",
+		    {.writeback = {.interval = 50ms, .bytesPerSecond = 256UZ * 1024 * 1024}}};
+
+		auto buffer = aw.allocate(count);
+		for (auto i : repeat(count)) {
+			buffer[i] = i;
+		}
+		std::this_thread::sleep_for(200ms);
+		std::cout << std::format("Dirty page cache seen by the writeback: {} MiB", aw.dirty_bytes() / 1024 / 1024) << std::endl;
+		aw.flush();
+		aw.deallocate(buffer, count);
+	}
+
+	std::cout << "A persistent arena survives the allocator. The next allocator on the same directory finds the data where it was left, "
+	             "linked by offset_ptr, which stays valid wherever the arena gets mapped."
+	          << std::endl;
+	std::cout << std::format("{:=^80}", "- mmf_allocator persistent usage -") << std::endl;
+	struct Node {
+		std::size_t                 value;
+		allocator::offset_ptr<Node> next;
+	};
+	const auto                   persistentDirectory = std::filesystem::current_path() / "mmf_persistent";
+	const allocator::mmf_options persistent{.arena = true, .segmentSize = 64 * 1024 * 1024, .persistent = true};
+	{
+		allocator::mmf_allocator<Node> writer{persistentDirectory, persistent};
+		Node*                          head = nullptr;
+		for (auto i : repeat(100)) {
+			head = new (writer.allocate(1)) Node{i, head};
+		}
+		writer.set_root(head);
+	}
+	{
+		allocator::mmf_allocator<Node> reader{persistentDirectory, persistent};
+		std::size_t                    sum = 0;
+		for (allocator::offset_ptr<Node> node = reader.root(); node; node = node->next) {
+			sum += node->value;
+		}
+		std::cout << std::format("Reopened the arena, the list sums up to {}", sum) << std::endl;
+	}
+	std::filesystem::remove_all(persistentDirectory);
 	std::cout << std::format("{:=^80}", "=") << std::endl;
 }
 
+// Aligned to a cache line, so it has to get cells on that alignment, not just on the alignment of the cell size
+struct alignas(64) cache_line {
+	std::size_t value;
+};
+
+// Single cache_lines and small arrays of them through a rebound copy of alloc, every one has to come back aligned
+template<typename Alloc>
+void aligned_test(const Alloc& alloc) {
+	typename std::allocator_traits<Alloc>::template rebind_alloc<cache_line> aligned{alloc};
+
+	std::vector<std::pair<cache_line*, std::size_t>> held;
+	for (auto i : repeat(100)) {
+		const std::size_t n = i % 4 + 1;
+		auto              p = aligned.allocate(n);
+		assert(reinterpret_cast<std::uintptr_t>(p) % alignof(cache_line) == 0);
+		held.emplace_back(p, n);
+	}
+	for (auto [p, n] : held) {
+		aligned.deallocate(p, n);
+	}
+	std::cout << std::format("{} allocations of cache_line, all aligned to {} bytes", held.size(), alignof(cache_line)) << std::endl;
+}
+
+// Rounds of arrays allocated and freed again, the freed runs have to serve the next rounds without any new block
+template<typename FreeList>
+void run_reuse_test(std::string_view name) {
+	allocator::block_adaptor<std::size_t, 64UZ * 1024, std::allocator, active_mutex, 0, FreeList, allocator::statistics> a;
+
+	constexpr std::size_t ROUNDS{6};
+	std::uint64_t         blocks{0};
+	for (auto round : repeat(ROUNDS)) {
+		std::vector<std::size_t*> arrays;
+		for (auto i : repeat(1000)) {
+			arrays.push_back(a.allocate(i % 200 + 1));
+		}
+		for (auto i : repeat(1000)) {
+			a.deallocate(arrays[i], i % 200 + 1);
+		}
+		if (round == 0) {
+			blocks = a.stats().blocks;
+		}
+		assert(a.stats().blocks == blocks);
+	}
+	std::cout << std::format("{:<28}{} rounds of 1000 arrays kept the pool at {} blocks", name, ROUNDS, blocks) << std::endl;
+}
+
 void block_adaptor() {
 	std::cout << std::format("{:=^80}", "- block_adaptor -") << std::endl;
 	std::cout
-	    << "This adaptor is a limited adaptor that can only allocate a single element and it can not be transformed into an adaptor of any other type. "
-	       "In exchange it is very fast and it can be used to allocate a large number of elements. It reuses all the memory it allocates, so it never "
-	       "shrinks. Internally it allocates a much bigger block of memory and subsequent calls slice this memory. This make it ideal in combination with a "
-	       "memory mapped file allocator. When replacing the standard std::allocator with this allocator adaptor and mallocator, the performance gain is "
-	       "usually an order of magnitude."
+	    << "This adaptor serves a single element from a cell of a fixed size, small arrays from a run of contiguous cells and bigger ones from the "
+	       "upstream allocator directly. Rebinding it to another type gives an adaptor with a pool of its own for that type, shared by all the copies "
+	       "rebound from one another, so node based containers can use it too. It is very fast and it can be used to allocate a large number of "
+	       "elements. It reuses all the memory it allocates and keeps it until trim() is called or its release_policy hands the completely free blocks "
+	       "back. Internally it allocates a much bigger block of memory and subsequent calls slice this memory. This make it ideal in combination with "
+	       "a memory mapped file allocator. When replacing the standard std::allocator with this allocator adaptor and mallocator, the performance gain "
+	       "is usually an order of magnitude."
 	    << std::endl;
 	std::cout << std::format("{:=^80}", "- block_adaptor usage -") << std::endl;
 
@@ -154,22 +429,59 @@ void block_adaptor() {
 	for (auto p : v) {
 		a.deallocate(p, 1);
 	}
+	std::cout << std::format("Released {} completely free blocks", a.trim()) << std::endl;
+
+	std::cout << "Using this adaptor as a vector allocator. Small arrays are served as runs of contiguous cells, big ones come from the "
+	             "upstream allocator directly."
+	          << std::endl;
+	std::vector<std::size_t, allocator::block_adaptor<std::size_t>> v2{a};
+	for (auto i : repeat(100)) {
+		v2.push_back(i);
+	}
 
-	std::cout << "This adaptor can not be used as a vector allocator, since you can only allocate individual elements." << std::endl;
+	std::cout << "Rebinding the adaptor to an over-aligned type" << std::endl;
+	aligned_test(a);
+
+	std::cout << "Arrays freed in one round serve the next ones, the pool stops growing after the first round" << std::endl;
+	run_reuse_test<allocator::locked_free_list>("locked_free_list");
+	run_reuse_test<allocator::lock_free_list>("lock_free_list");
 
 	std::cout << std::format("{:=^80}", "- block_adaptor parallel test -") << std::endl;
 	allocator::block_adaptor<std::size_t, 4UZ * 1024 * 1024, std::allocator, active_mutex> ap; // smaller block size, so more blocks are allocated for the test
 	std::cout << std::format("{}", parallel_test(ap)) << std::endl;
+
+	std::cout << std::format("{:=^80}", "- block_adaptor magazine parallel test -") << std::endl;
+	std::cout << "With MAGAZINE_SIZE set, every thread keeps its own cache of free cells and goes to the shared blocks only once per MAGAZINE_SIZE "
+	             "allocations, so the threads rarely meet on a lock."
+	          << std::endl;
+	allocator::block_adaptor<std::size_t, 4UZ * 1024 * 1024, std::allocator, active_mutex, 64> am;
+	std::cout << std::format("{}", parallel_test(am)) << std::endl;
+
+	std::cout << std::format("{:=^80}", "- block_adaptor lock-free parallel test -") << std::endl;
+	std::cout << "With lock_free_list the cells are taken from and given back to the blocks without any lock, the Mutex is only taken "
+	             "to switch to another block."
+	          << std::endl;
+	allocator::block_adaptor<std::size_t, 4UZ * 1024 * 1024, std::allocator, active_mutex, 0, allocator::lock_free_list> al;
+	std::cout << std::format("{}", parallel_test(al)) << std::endl;
+
+	std::cout << std::format("{:=^80}", "- block_adaptor producer/consumer test -") << std::endl;
+	std::cout << "Messages allocated on one thread and freed on another. With remote_free_queue the consumers queue the cells at their "
+	             "blocks without any lock and the producer gives them back in bulk on its next allocation."
+	          << std::endl;
+	allocator::block_adaptor<std::size_t, 4UZ * 1024 * 1024, std::allocator, active_mutex, 64>                               pl;
+	allocator::block_adaptor<std::size_t, 4UZ * 1024 * 1024, std::allocator, active_mutex, 64, allocator::remote_free_queue> pr;
+	std::cout << std::format("{:<28}{}", "locked_free_list", producer_consumer_test(pl)) << std::endl;
+	std::cout << std::format("{:<28}{}", "remote_free_queue", producer_consumer_test(pr)) << std::endl;
 	std::cout << std::format("{:=^80}", "=") << std::endl;
 }
 
 void universal_block_adaptor() {
 	std::cout << std::format("{:=^80}", "- universal_block_adaptor -") << std::endl;
 	std::cout << "This adaptor was developed in order to overcome the limitation of the block_allocator that can not be converted into any adaptor of "
-	             "a different type. Internally it uses a series of block_adaptor to allocate memory of different sizes. It can potentially waste up "
-	             "to 50% of the space if the element size is n^2+1. It is still much faster than the standard allocator, but slower than the "
-	             "block_adaptor, yet it can allocate only 1 element at a time. This limits the usage, since it can not be used for a vector, but can "
-	             "be used for a shared_ptr for example."
+	             "a different type. Internally it uses a series of block_adaptor to allocate memory of different sizes. With the default size classes it can "
+	             "potentially waste up to 50% of the space if the element size is n^2+1, geometric_size_classes<4> cuts that to about 20%. It is still much "
+	             "faster than the standard allocator, but slower than the block_adaptor. Arrays take the size class that fits the whole array and anything "
+	             "bigger than the largest class comes from the upstream allocator, so a single instance can serve vectors, maps and shared_ptrs alike."
 	          << std::endl;
 	std::cout << std::format("{:=^80}", "- universal_block_adaptor usage -") << std::endl;
 
@@ -198,10 +510,30 @@ void universal_block_adaptor() {
 		a2.deallocate(p, 1);
 	}
 
-	std::cout << "This adaptor can not be used as a vector allocator, since you can only allocate individual elements." << std::endl;
+	std::cout << "Using the same adaptor as a vector allocator" << std::endl;
+	std::vector<std::size_t, allocator::universal_block_adaptor<std::size_t>> v3{a};
+	for (auto i : repeat(100)) {
+		v3.push_back(i);
+	}
+
+	std::cout << "Rebinding the adaptor to an over-aligned type" << std::endl;
+	aligned_test(a);
+
 	std::cout << std::format("{:=^80}", "- universal_block_adaptor parallel test -") << std::endl;
 	allocator::universal_block_adaptor<std::size_t, 8UZ, 4UZ * 1024 * 1024, std::allocator, active_mutex> ap;
 	std::cout << std::format("{}", parallel_test(ap)) << std::endl;
+
+	std::cout << std::format("{:=^80}", "- universal_block_adaptor sharded by CPU -") << std::endl;
+	using sharded_type = allocator::universal_block_adaptor<
+	    std::size_t, 8UZ, 4UZ * 1024 * 1024, std::allocator, active_mutex, 0, allocator::geometric_size_classes<>, 64>;
+	sharded_type as;
+	std::cout << std::format("{}", parallel_test(as)) << std::endl;
+
+	// Still one allocator, a rebound copy frees what the original allocated on any CPU
+	std::allocator_traits<sharded_type>::rebind_alloc<double> as2{as};
+	auto                                                      p = as.allocate(1);
+	std::cout << std::format("Rebound copy compares equal: {}", as2 == as) << std::endl;
+	std::allocator_traits<sharded_type>::rebind_alloc<std::size_t>{as2}.deallocate(p, 1);
 	std::cout << std::format("{:=^80}", "=") << std::endl;
 }
 
@@ -238,6 +570,205 @@ void round_robin_adaptor() {
 	std::cout << std::format("{:=^80}", "=") << std::endl;
 }
 
+// Stands for a child that stalls, like an SSD with its SLC cache exhausted
+template<typename T>
+struct stalling_allocator : allocator::mallocator<T> {
+	std::chrono::microseconds stall;
+
+	explicit stalling_allocator(std::chrono::microseconds stall = {}) : stall{stall} {
+	}
+
+	[[nodiscard]] auto allocate(std::size_t n) -> T* {
+		if (stall.count() != 0) {
+			std::this_thread::sleep_for(stall);
+		}
+		return allocator::mallocator<T>::allocate(n);
+	}
+};
+
+template<typename Policy>
+void balancing_benchmark(std::string_view name) {
+	using Child = stalling_allocator<std::size_t>;
+	using Alloc = allocator::balancing_adaptor<std::size_t, Policy, active_mutex, Child, Child, Child, Child>;
+	Alloc a{Child{std::chrono::microseconds{100}}, Child{}, Child{}, Child{}};
+
+	std::cout << std::format("{:<28}{}", name, parallel_test(a, 100'000)) << std::endl;
+}
+
+void balancing_adaptor() {
+	std::cout << std::format("{:=^80}", "- balancing_adaptor -") << std::endl;
+	std::cout << "round_robin_adaptor is the balancing_adaptor with the round_robin_policy. When one of the children stalls, it still gets its "
+	             "share of the traffic. The other policies look at the load, the weights, the threads or the latency of the children."
+	          << std::endl;
+	std::cout << std::format("{:=^80}", "- balancing_adaptor one slow child test -") << std::endl;
+	balancing_benchmark<allocator::round_robin_policy>("round_robin_policy");
+	balancing_benchmark<allocator::least_outstanding_policy>("least_outstanding_policy");
+	balancing_benchmark<allocator::weighted_policy<1, 5, 5, 5>>("weighted_policy<1, 5, 5, 5>");
+	balancing_benchmark<allocator::thread_affine_policy>("thread_affine_policy");
+	balancing_benchmark<allocator::latency_feedback_policy<>>("latency_feedback_policy");
+	std::cout << std::format("{:=^80}", "=") << std::endl;
+}
+
+template<typename Mutex>
+void mutex_benchmark(std::string_view name) {
+	using Alloc = allocator::block_adaptor<std::size_t, 4LL * 1024 * 1024, allocator::mallocator, Mutex>;
+	Alloc oversubscribed;
+	Alloc matched;
+
+	std::cout << std::format("{:<28}{:>16}{:>16}", name, parallel_test(oversubscribed).total, parallel_test(matched, DEFAULT_REPETITIONS, 1).total)
+	          << std::endl;
+}
+
+// How long every single lock() takes, with threads fighting for a short critical section
+template<typename Mutex>
+void lock_latency(std::string_view name) {
+	using namespace std::chrono;
+	const auto            concurrency = 4 * std::thread::hardware_concurrency();
+	constexpr std::size_t acquisitions{400'000};
+
+	Mutex                                     mutex;
+	std::size_t                               shared{0};
+	std::barrier                              b{concurrency};
+	std::vector<benchmark::latency_histogram> latencies(concurrency);
+
+	auto start = high_resolution_clock::now();
+	{
+		std::vector<std::jthread> threads;
+		for (auto t : repeat(concurrency)) {
+			threads.emplace_back([&, t] {
+				auto& mine = latencies[t];
+				b.arrive_and_wait();
+				for ([[maybe_unused]] auto i : repeat(acquisitions / concurrency)) {
+					auto before = high_resolution_clock::now();
+					{
+						std::scoped_lock lock{mutex};
+						++shared;
+					}
+					mine.record(high_resolution_clock::now() - before);
+				}
+			});
+		}
+	}
+	auto total = duration_cast<microseconds>(high_resolution_clock::now() - start);
+
+	benchmark::latency_histogram all;
+	for (const auto& mine : latencies) {
+		all.merge(mine);
+	}
+	std::cout << std::format("{:<16}{:>12}  {}", name, total, percentiles(all)) << std::endl;
+}
+
+void mutexes() {
+	std::cout << std::format("{:=^80}", "- mutexes -") << std::endl;
+	std::cout << "The adaptors take the Mutex as a policy. active_mutex spins, which is the fastest as long as every thread has a core of its own. "
+	             "adaptive_mutex spins with a backoff for a short while and then parks the thread, so a preempted owner does not make the waiters "
+	             "burn their timeslices."
+	          << std::endl;
+	std::cout << std::format("{:=^80}", "- block_adaptor with 4 and 1 threads per core -") << std::endl;
+	mutex_benchmark<std::mutex>("std::mutex");
+	mutex_benchmark<active_mutex>("active_mutex");
+	mutex_benchmark<adaptive_mutex>("adaptive_mutex");
+	mutex_benchmark<mcs_mutex>("mcs_mutex");
+
+	std::cout << "mcs_mutex queues the waiters, each spinning on its own cache line, and hands the lock over in the order they came, so no "
+	             "waiter starves. It trades some throughput for the tail latency."
+	          << std::endl;
+	std::cout << std::format("{:=^80}", "- lock latency, total, p50/p99/p99.9/max -") << std::endl;
+	lock_latency<std::mutex>("std::mutex");
+	lock_latency<active_mutex>("active_mutex");
+	lock_latency<adaptive_mutex>("adaptive_mutex");
+	lock_latency<mcs_mutex>("mcs_mutex");
+	std::cout << std::format("{:=^80}", "=") << std::endl;
+}
+
+template<typename Stats>
+void print_stats(std::string_view name, const Stats& stats) {
+	std::cout << name << std::endl;
+	for (auto [field, value] : stats.fields()) {
+		std::cout << std::format("  {:<24}{:>16}", field, value) << std::endl;
+	}
+}
+
+void statistics() {
+	std::cout << std::format("{:=^80}", "- statistics -") << std::endl;
+	std::cout << "With the statistics policy the allocators count their allocations, the blocks they hold upstream and how often their lock was "
+	             "found taken. Every thread counts on its own cache line, the counters are summed only when stats() takes a snapshot, and with "
+	             "the default no_statistics nothing is counted at all."
+	          << std::endl;
+
+	allocator::block_adaptor<std::size_t, 4UZ * 1024 * 1024, std::allocator, active_mutex, 64, allocator::locked_free_list, allocator::statistics> a;
+	parallel_test(a, 100'000);
+	std::vector<std::size_t*> held;
+	for (auto i : repeat(1000)) {
+		held.push_back(a.allocate(1));
+		*held.back() = i;
+	}
+	print_stats("block_adaptor holding 1000 cells", a.stats());
+	for (auto p : held) {
+		a.deallocate(p, 1);
+	}
+
+	using universal_type   = allocator::universal_block_adaptor<
+	    std::byte, 6UZ, 4UZ * 1024 * 1024, std::allocator, dummy_mutex, 0, allocator::geometric_size_classes<>, 1, allocator::statistics>;
+	using node_alloc_type  = std::allocator_traits<universal_type>::rebind_alloc<std::pair<const std::size_t, std::size_t>>;
+	using array_alloc_type = std::allocator_traits<universal_type>::rebind_alloc<std::size_t>;
+
+	universal_type                                                   u;
+	std::map<std::size_t, std::size_t, std::less<>, node_alloc_type> nodes{node_alloc_type{u}};
+	std::vector<std::size_t, array_alloc_type>                       array{array_alloc_type{u}};
+	for (auto i : repeat(100)) {
+		nodes.emplace(i, i);
+		array.push_back(i);
+	}
+	const auto classes = u.stats();
+	for (auto i : repeat(universal_type::SIZES.size())) {
+		std::cout << std::format(
+		                 "universal_block_adaptor class {:>4}B: {} live, {} bytes in use",
+		                 universal_type::SIZES[i],
+		                 classes[i].liveObjects,
+		                 classes[i].bytesInUse)
+		          << std::endl;
+	}
+	std::cout << std::format("universal_block_adaptor large: {} live, {} bytes in use", classes.back().liveObjects, classes.back().bytesInUse) << std::endl;
+
+	using child_type  = allocator::block_adaptor<
+	    std::size_t, 1024UZ * 1024, std::allocator, active_mutex, 0, allocator::locked_free_list, allocator::statistics>;
+	using policy_type = allocator::with_statistics<allocator::least_outstanding_policy>;
+	allocator::balancing_adaptor<std::size_t, policy_type, active_mutex, child_type, child_type> b{child_type{}, child_type{}};
+	parallel_test(b, 100'000);
+	const auto children = b.stats();
+	for (auto child : repeat(children.size())) {
+		print_stats(std::format("balancing_adaptor child {}", child), children[child]);
+	}
+
+	allocator::mmf_allocator<std::size_t, active_mutex, allocator::statistics> m{"", {.memfd = true}};
+	auto                                                                       p = m.allocate(1024);
+	print_stats("mmf_allocator holding one mapping", m.stats());
+	m.deallocate(p, 1024);
+	std::cout << std::format("{:=^80}", "=") << std::endl;
+}
+
+void resource_adaptor() {
+	std::cout << std::format("{:=^80}", "- resource_adaptor -") << std::endl;
+	std::cout << "Any of the allocators can back std::pmr containers through the resource_adaptor. The requests come with their size and "
+	             "alignment at run time, the universal_block_adaptor picks the size class by a table lookup."
+	          << std::endl;
+	std::cout << std::format("{:=^80}", "- resource_adaptor usage -") << std::endl;
+
+	allocator::resource_adaptor<allocator::universal_block_adaptor<>> resource;
+
+	std::cout << "Filling a std::pmr::map of std::pmr::strings" << std::endl;
+	std::pmr::map<std::size_t, std::pmr::string> m{&resource};
+	for (auto i : repeat(100)) {
+		m.emplace(i, std::pmr::string(i, 'x'));
+	}
+
+	std::cout << "Moving between containers on equal resources does not copy the elements" << std::endl;
+	allocator::resource_adaptor<allocator::universal_block_adaptor<>> same{resource.get_allocator()};
+	std::pmr::map<std::size_t, std::pmr::string> m2{std::move(m), &same};
+	std::cout << std::format("{:=^80}", "=") << std::endl;
+}
+
 void ultimate_infinite_capacity_speed() {
 	std::cout << std::format("{:=^80}", "- ultimate_infinite_capacity_speed -") << std::endl;
 	std::cout << "By combining allocators and adaptors you can achieve various behaviours. Once at my job we had a big challenge to cache data from detectors "
@@ -276,6 +807,10 @@ auto main([[maybe_unused]] int argc, [[maybe_unused]] char const* argv[]) -> int
 		block_adaptor();
 		universal_block_adaptor();
 		round_robin_adaptor();
+		balancing_adaptor();
+		mutexes();
+		statistics();
+		resource_adaptor();
 		ultimate_infinite_capacity_speed();
 
 		return EXIT_SUCCESS;
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#	include <linux/perf_event.h>
+#	include <sys/ioctl.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#	define BENCHMARK_PERF_EVENTS
+#endif
+
+namespace benchmark {
+
+/*
+	Hardware and software counters of the calling thread and every thread it starts after the counters were opened,
+	read through perf_event_open. The kernel part is counted where perf_event_paranoid allows it, otherwise only the user
+	space part. A counter the machine or the permissions do not offer (virtual machines often lack the cache events)
+	reads as std::nullopt, and so do all of them off Linux.
+*/
+class perf_counters {
+public:
+	enum counter : std::size_t { cache_misses, page_faults, context_switches, COUNTERS };
+
+	using values = std::array<std::optional<std::uint64_t>, COUNTERS>;
+
+	perf_counters() {
+#if defined(BENCHMARK_PERF_EVENTS)
+		constexpr std::array<std::pair<std::uint32_t, std::uint64_t>, COUNTERS> events{{
+		    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+		    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+		    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+		}};
+		for (std::size_t i{0}; i < COUNTERS; ++i) {
+			_fds[i] = open(events[i].first, events[i].second);
+		}
+#endif
+	}
+
+	perf_counters(const perf_counters&)                    = delete;
+	perf_counters(perf_counters&&)                         = delete;
+	auto operator=(const perf_counters&) -> perf_counters& = delete;
+	auto operator=(perf_counters&&) -> perf_counters&      = delete;
+
+	~perf_counters() {
+#if defined(BENCHMARK_PERF_EVENTS)
+		for (auto fd : _fds) {
+			if (fd >= 0) {
+				::close(fd);
+			}
+		}
+#endif
+	}
+
+	void start() noexcept {
+#if defined(BENCHMARK_PERF_EVENTS)
+		for (auto fd : _fds) {
+			if (fd >= 0) {
+				::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	void stop() noexcept {
+#if defined(BENCHMARK_PERF_EVENTS)
+		for (auto fd : _fds) {
+			if (fd >= 0) {
+				::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			}
+		}
+#endif
+	}
+
+	// The threads that counted have to be joined first, only then their counts are added to the opening thread
+	[[nodiscard]] auto read() const noexcept -> values {
+		values result{};
+#if defined(BENCHMARK_PERF_EVENTS)
+		for (std::size_t i{0}; i < COUNTERS; ++i) {
+			std::uint64_t value{0};
+			if (_fds[i] >= 0 && ::read(_fds[i], &value, sizeof(value)) == sizeof(value)) {
+				result[i] = value;
+			}
+		}
+#endif
+		return result;
+	}
+
+private:
+#if defined(BENCHMARK_PERF_EVENTS)
+	static auto open(std::uint32_t type, std::uint64_t config) noexcept -> int {
+		perf_event_attr attr{};
+		attr.size       = sizeof(attr);
+		attr.type       = type;
+		attr.config     = config;
+		attr.disabled   = 1;
+		attr.inherit    = 1;
+		attr.exclude_hv = 1;
+		for (const auto excludeKernel : {0U, 1U}) {
+			attr.exclude_kernel = excludeKernel;
+			if (const auto fd = ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC); fd >= 0) {
+				return static_cast<int>(fd);
+			}
+		}
+		return -1;
+	}
+#endif
+
+	std::array<int, COUNTERS> _fds{-1, -1, -1};
+};
+
+} // namespace benchmark